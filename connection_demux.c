@@ -65,7 +65,47 @@ HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
                    MAX_NUM_CONNECTIONS);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
+/* established connections, for network layers that share a socket (and
+ * so a local port) amongst several mysockets.  incoming packets are
+ * demultiplexed on the peer's address and port and the local port; the
+ * lock is only taken for writing when connections come and go.
+ */
+typedef struct
+{
+    uint32_t peer_addr;     /* network byte order */
+    uint16_t peer_port;     /* network byte order */
+    uint16_t local_port;    /* network byte order */
+} connection_key_t;
+
+#define CONNECTION_TABLE_SIZE 4096
+
+static __inline bool_t _connection_key_equal(connection_key_t a,
+                                             connection_key_t b)
+{
+    return a.peer_addr == b.peer_addr && a.peer_port == b.peer_port &&
+           a.local_port == b.local_port;
+}
+
+static __inline unsigned int _connection_hash(connection_key_t key,
+                                              unsigned int size)
+{
+    uint32_t h = key.peer_addr ^ ((uint32_t) key.peer_port << 16) ^
+                 key.local_port;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h % size;
+}
+
+HASH_TABLE_DECLARE_EXTENDED(connection_table, connection_key_t,
+                            mysock_context_t *, _connection_hash,
+                            _connection_key_equal, CONNECTION_TABLE_SIZE);
+static pthread_rwlock_t connection_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
+static connection_key_t _connection_key(const struct sockaddr *peer_addr,
+                                        uint16_t local_port);
 
 
 /* called by myaccept() to grab the first completed connection off the
@@ -220,6 +260,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        new_ctx->opts = ctx->opts;  /* inherit the listener's options */
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -404,3 +445,93 @@ static listen_queue_t *_get_connection_queue(mysock_context_t *ctx)
     return HASH_LOOKUP_PTR(listen_table, ctx->my_sd);
 }
 
+
+/* record ctx, whose peer address is known, as the connection to its peer
+ * from the given local port (network byte order).  returns FALSE if
+ * another mysocket already has that connection.
+ */
+bool_t _mysock_register_connection(mysock_context_t *ctx, uint16_t local_port)
+{
+    connection_key_t key;
+    bool_t rc = FALSE;
+
+    assert(ctx && ctx->network_state.peer_addr_valid);
+
+    key = _connection_key(&ctx->network_state.peer_addr, local_port);
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&connection_lock));
+    if (!HASH_ENTRY_EXISTS(connection_table, key))
+    {
+        HASH_INSERT(connection_table, key, ctx);
+        rc = TRUE;
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&connection_lock));
+
+    return rc;
+}
+
+/* remove ctx's entry, added by _mysock_register_connection().  once this
+ * returns, no further packets are dispatched to ctx.
+ */
+void _mysock_unregister_connection(mysock_context_t *ctx, uint16_t local_port)
+{
+    connection_key_t key;
+
+    assert(ctx && ctx->network_state.peer_addr_valid);
+
+    key = _connection_key(&ctx->network_state.peer_addr, local_port);
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&connection_lock));
+    assert(HASH_LOOKUP_PTR(connection_table, key) == ctx);
+    HASH_DELETE(connection_table, key);
+    PTHREAD_CALL(pthread_rwlock_unlock(&connection_lock));
+}
+
+/* queue a packet, which arrived from peer_addr at the given local port,
+ * for the connection it belongs to.  the packet is the given slice of
+ * *buf; the connection's queue takes over the reference to *buf, and *buf
+ * is set to NULL.  returns FALSE (leaving *buf alone) if there's no such
+ * connection, in which case the packet may be a connection request.
+ */
+bool_t _mysock_dispatch_packet(uint16_t               local_port,
+                               const struct sockaddr *peer_addr,
+                               mysock_buf_t         **buf,
+                               const void            *packet,
+                               size_t                 packet_len)
+{
+    mysock_context_t *ctx;
+    connection_key_t key;
+
+    assert(peer_addr && buf && *buf && packet);
+
+    key = _connection_key(peer_addr, local_port);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&connection_lock));
+    if ((ctx = HASH_LOOKUP_PTR(connection_table, key)) != NULL)
+    {
+        struct iovec slice;
+
+        slice.iov_base = (void *) packet;
+        slice.iov_len  = packet_len;
+        _mysock_enqueue_refs(ctx, &ctx->network_recv_queue, buf, &slice, 1);
+        *buf = NULL;
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&connection_lock));
+
+    return (ctx != NULL);
+}
+
+static connection_key_t _connection_key(const struct sockaddr *peer_addr,
+                                        uint16_t local_port)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) peer_addr;
+    connection_key_t key;
+
+    assert(peer_addr && peer_addr->sa_family == AF_INET);
+
+    memset(&key, 0, sizeof(key));
+    key.peer_addr  = sin->sin_addr.s_addr;
+    key.peer_port  = sin->sin_port;
+    key.local_port = local_port;
+    return key;
+}
@@ -1,5 +1,6 @@
-/* connection_demux.h--demultiplex SYN requests on a listening socket.
- * this is an internal header, used only by the mysocket layer.
+/* connection_demux.h--demultiplex SYN requests on a listening socket, and
+ * packets on sockets shared by several connections.  this is an internal
+ * header, used only by the mysocket and network layers.
  */
 
 #ifndef __CONNECTION_DEMUX_H__
@@ -22,5 +23,21 @@ void _mysock_close_passive_socket(struct mysock_context *ctx);
 
 void _mysock_passive_connection_complete(struct mysock_context *new_ctx);
 
+/* demultiplexing of established connections, by peer address and port
+ * and local port, for network layers that share one socket amongst
+ * several mysockets.
+ */
+struct mysock_buf;
+
+bool_t _mysock_register_connection(struct mysock_context *ctx,
+                                   uint16_t               local_port);
+void _mysock_unregister_connection(struct mysock_context *ctx,
+                                   uint16_t               local_port);
+bool_t _mysock_dispatch_packet(uint16_t               local_port,
+                               const struct sockaddr *peer_addr,
+                               struct mysock_buf    **buf,
+                               const void            *packet,
+                               size_t                 packet_len);
+
 #endif  /* __CONNECTION_DEMUX_H__ */
 
@@ -9,7 +9,9 @@
 #include <pthread.h>
 #include "mysock.h"
 #include "mysock_impl.h"
+#include "mysock_coro.h"
 #include "network_io.h"
+#include "network_emu.h"
 #include "stcp_api.h"
 #include "transport.h"
 
@@ -95,14 +97,94 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
         abort();
     }
 
+#ifdef MYSOCK_COROUTINES
+    /* run the transport layer as a coroutine on the shared scheduler */
+    if (_mysock_coro_spawn(connection_context, transport_thread_func) < 0)
+    {
+        assert(0);
+        abort();
+    }
+#else
     /* start a new transport layer thread */
     connection_context->transport_thread = _mysock_create_thread(
         transport_thread_func,
         connection_context,
         FALSE);
+#endif
     connection_context->transport_thread_started = TRUE;
 }
 
+/* block until the transport layer thread (or coroutine) exits */
+void _mysock_join_transport(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->transport_thread_started);
+
+#ifdef MYSOCK_COROUTINES
+    _mysock_coro_join(ctx);
+#else
+    PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
+#endif
+    ctx->transport_thread_started = FALSE;
+}
+
+/* wait for cond (one of the context's per-consumer condition variables) to
+ * be signaled, or for abstime (if non-NULL) to pass.  the caller must hold
+ * data_ready_lock, which is held again on return.  returns 0 or ETIMEDOUT.
+ *
+ * inside a transport coroutine this yields to the scheduler rather than
+ * blocking the (shared) OS thread.
+ */
+int _mysock_wait_data_ready(mysock_context_t      *ctx,
+                            pthread_cond_t        *cond,
+                            const struct timespec *abstime)
+{
+    int rc;
+
+    assert(ctx && cond);
+
+    if (_mysock_coro_active())
+    {
+        assert(cond == &ctx->transport_cond);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        rc = _mysock_coro_wait(ctx, abstime);
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        return rc;
+    }
+
+    if (!abstime)
+    {
+        PTHREAD_CALL(pthread_cond_wait(cond, &ctx->data_ready_lock));
+        return 0;
+    }
+
+    switch ((rc = pthread_cond_timedwait(cond, &ctx->data_ready_lock,
+                                         abstime)))
+    {
+    case 0:     /* some data might be available */
+    case EINTR:
+        return 0;
+
+    case ETIMEDOUT: /* no data arrived in the specified time */
+        return ETIMEDOUT;
+
+    default:
+        assert(0);
+        return rc;
+    }
+}
+
+/* wake the consumer waiting on cond in _mysock_wait_data_ready() */
+void _mysock_signal_data_ready(mysock_context_t *ctx, pthread_cond_t *cond)
+{
+    assert(ctx && cond);
+
+    PTHREAD_CALL(pthread_cond_broadcast(cond));
+#ifdef MYSOCK_COROUTINES
+    if (cond == &ctx->transport_cond)
+        _mysock_coro_wake(ctx);
+#endif
+}
+
 int _mysock_wait_for_connection(mysock_context_t *ctx)
 {
     assert(ctx);
@@ -125,46 +207,92 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
  * application is ready to use it, depending on the queue to which
  * the buffer (or packet) is added.
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * this copies the specified buffer for its own use, so the calling code can
+ * do whatever it wants with the packet afterwards.  the copy is released
+ * later by dequeue_buffer().  use _mysock_enqueue_refs() to queue data that
+ * is already in a mysock_buf_t without copying it.
  */
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
                             const void       *packet,
                             size_t            packet_len)
 {
-    packet_queue_node_t *node;
+    mysock_buf_t *buf = NULL;
+    struct iovec  slice;
 
     assert(ctx && pq && (packet || !packet_len));
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
-
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    slice.iov_base = NULL;
+    slice.iov_len  = packet_len;
 
     if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+    {
+        buf = _mysock_buf_alloc(packet_len);
+        memcpy(buf->data, packet, packet_len);
+        slice.iov_base = buf->data;
+    }
+
+    _mysock_enqueue_refs(ctx, pq, &buf, &slice, 1);
+}
+
+/* append count slices to a queue, with a single wakeup of the consumer.
+ * slices[i] must lie within bufs[i] (or be zero-length, with bufs[i] NULL);
+ * the queue takes over one reference to each buffer from the caller.
+ */
+void _mysock_enqueue_refs(mysock_context_t   *ctx,
+                          packet_queue_t     *pq,
+                          mysock_buf_t *const *bufs,
+                          const struct iovec *slices,
+                          int                 count)
+{
+    packet_queue_node_t *first = NULL, *last = NULL;
+    size_t bytes = 0;
+    bool_t was_empty;
+    int k;
+
+    assert(ctx && pq && bufs && slices && count > 0);
+
+    for (k = 0; k < count; ++k)
+    {
+        packet_queue_node_t *node;
+
+        assert(bufs[k] || !slices[k].iov_len);
+
+        node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
+        assert(node);
+
+        node->data     = (char *) slices[k].iov_base;
+        node->data_len = slices[k].iov_len;
+        node->buf      = bufs[k];
+        bytes += node->data_len;
+
+        if (last)
+            last->next = node;
+        else
+            first = node;
+        last = node;
+    }
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+    was_empty = (pq->head == NULL);
+    if (was_empty)
     {
         assert(!pq->tail);
-        pq->head = pq->tail = node;
+        pq->head = first;
     }
     else
     {
         assert(pq->tail);
         assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        pq->tail->next = first;
     }
+    pq->tail = last;
+    pq->bytes += bytes;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    /* the consumer only ever waits for an empty queue */
+    if (was_empty)
+        _mysock_signal_data_ready(ctx, pq->ready_cond);
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -182,35 +310,34 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
 {
     packet_queue_node_t *node;
     size_t               packet_len;
-    char *mid;
+    bool_t               wake_writer;
 
     assert(ctx && pq && dst);
 
     /* block until queue is non-empty */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     while (!pq->head)
-    {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
+        (void) _mysock_wait_data_ready(ctx, pq->ready_cond, NULL);
 
     node = pq->head;
-    
-    mid = malloc(node->data_len - max_len);
+    assert(node && (node->data || !node->data_len));
 
-    assert(node && node->data);
+    /* a writer blocked in mywrite() may proceed once the transport takes
+     * data off the send queue.
+     */
+    wake_writer = (pq == &ctx->app_recv_queue) && ctx->writers_waiting > 0;
 
     if (node->data_len > max_len && remove_partial)
     {
         /* remove only a portion of the packet at the head of the queue,
          * leaving the rest around for the next call to dequeue_buffer().
+         * only the consumer touches the head node's data, so the copy can
+         * be done outside the lock.
          */
+        pq->bytes -= max_len;
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
         memcpy(dst, node->data, max_len);
-	memcpy(mid , node->data + max_len, node->data_len-max_len);
-	/* memcpy(node->data, node->data + max_len, node->data_len - max_len);*/
-	memcpy(node->data , mid , node->data_len-max_len);
-	/*printf("%s\n",dst);*/
+        node->data     += max_len;
         node->data_len -= max_len;
         packet_len = max_len;
     }
@@ -222,20 +349,127 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
             assert(pq->tail == node);
             pq->tail = NULL;
         }
+        pq->bytes -= node->data_len;
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
+        if (node->data_len > 0)
+            memcpy(dst, node->data, MIN(max_len, node->data_len));
         packet_len = node->data_len;
 
-        free(node->data);
+        _mysock_buf_release(node->buf);
 
         memset(node, 0, sizeof(*node));
         free(node);
     }
 
+    if (wake_writer)
+        _mysock_signal_data_ready(ctx, &ctx->writer_cond);
+
+    return packet_len;
+}
+
+/* remove the packet at the head of the queue without copying it, blocking
+ * until one is available.  *data is set to the packet, and *buf to the
+ * buffer holding it; the caller inherits the queue's reference to *buf, and
+ * must release it with _mysock_buf_release().  returns the packet length.
+ */
+size_t _mysock_dequeue_ref(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           mysock_buf_t    **buf,
+                           void            **data)
+{
+    size_t packet_len;
+
+    (void) _mysock_dequeue_refs(ctx, pq, buf, data, &packet_len, 1);
     return packet_len;
 }
 
+/* as _mysock_dequeue_ref(), but remove up to max_count packets (at least
+ * one, blocking until it arrives) with a single acquisition of the queue
+ * lock.  bufs[i], data[i] and lens[i] describe the i'th packet.  returns
+ * the number of packets dequeued.
+ */
+int _mysock_dequeue_refs(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         mysock_buf_t    **bufs,
+                         void            **data,
+                         size_t           *lens,
+                         int               max_count)
+{
+    packet_queue_node_t *node, *rest;
+    bool_t               wake_writer;
+    int                  count = 0;
+
+    assert(ctx && pq && bufs && data && lens && max_count > 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+        (void) _mysock_wait_data_ready(ctx, pq->ready_cond, NULL);
+
+    /* detach the first max_count nodes */
+    node = pq->head;
+    for (rest = node; rest && count < max_count; rest = rest->next)
+    {
+        pq->bytes -= rest->data_len;
+        ++count;
+    }
+    if (!(pq->head = rest))
+        pq->tail = NULL;
+    wake_writer = (pq == &ctx->app_recv_queue) && ctx->writers_waiting > 0;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    for (count = 0; node != rest; ++count)
+    {
+        packet_queue_node_t *next = node->next;
+
+        bufs[count] = node->buf;
+        data[count] = node->data;
+        lens[count] = node->data_len;
+
+        memset(node, 0, sizeof(*node));
+        free(node);
+        node = next;
+    }
+
+    if (wake_writer)
+        _mysock_signal_data_ready(ctx, &ctx->writer_cond);
+
+    return count;
+}
+
+/* copy up to max_len bytes of any further data already waiting in the queue
+ * into dst, without blocking.  this stops short of a zero-length (EOF)
+ * packet, leaving it queued.  returns the number of bytes copied.
+ */
+size_t _mysock_dequeue_more(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len)
+{
+    char  *cdst = (char *) dst;
+    size_t total = 0;
+
+    assert(ctx && pq && dst);
+
+    while (total < max_len)
+    {
+        bool_t available;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        available = (pq->head && pq->head->data_len > 0);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        /* only the consumer removes nodes, so the head can't go away */
+        if (!available)
+            break;
+
+        total += _mysock_dequeue_buffer(ctx, pq, cdst + total,
+                                        max_len - total, TRUE);
+    }
+
+    return total;
+}
+
 /* free any last buffers in the specified queue, discarding the contents.
  * this is called only when the mysocket context is being deallocated, so
  * there are no concerns about thread safety here.  returns TRUE if
@@ -255,12 +489,13 @@ static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
         if (node->data_len > 0)
             result = TRUE;
 
-        free(node->data);
+        _mysock_buf_release(node->buf);
         free(node);
         node = next;
     }
 
     pq->head = pq->tail = NULL;
+    pq->bytes = 0;
     return result;
 }
 
@@ -285,14 +520,29 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
 
-    /* initialise data ready condition variable.  this is signaled when
-     * data is ready from the application or the network.
+    /* initialise data ready lock and condition variables.  these are
+     * signaled when data is ready from the application or the network.
      */
-    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->transport_cond, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->reader_cond, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->writer_cond, NULL));
+
+    ctx->network_recv_queue.ready_cond = &ctx->transport_cond;
+    ctx->app_recv_queue.ready_cond     = &ctx->transport_cond;
+    ctx->app_send_queue.ready_cond     = &ctx->reader_cond;
+
+    PTHREAD_CALL(pthread_mutex_init(&ctx->info_lock, NULL));
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
+    ctx->opts.sndbuf       = MYSOCK_DEFAULT_SNDBUF;
+    ctx->opts.rcvbuf       = MYSOCK_DEFAULT_RCVBUF;
+    ctx->opts.congestion   = MYSOCK_CC_NONE;
+    ctx->opts.initial_cwnd = 1;
+    ctx->opts.mss          = STCP_MSS;
+    ctx->opts.checksum     = MYSOCK_CSUM_FULL;
+
 
     /* initialise underlying network state.  this includes creating the actual
      * socket used for communication to the peer--this is analogous to the
@@ -320,9 +570,13 @@ void _mysock_free_context(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->transport_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->reader_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->writer_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
 
+    PTHREAD_CALL(pthread_mutex_destroy(&ctx->info_lock));
+
     /* free any last buffers that might be lying around (e.g. retransmitted
      * packets from the peer).  normally, the application from/to queues
      * should be empty by this point; the network receive queue may
@@ -332,6 +586,7 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
+    _network_emu_close(&ctx->network_state);
     _network_close(&ctx->network_state);
 
     /* clear mysocket descriptor table entry */
@@ -391,6 +646,14 @@ static void *transport_thread_func(void *arg_ptr)
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     }
 
+    /* nothing will drain the send queue from here on; don't leave a
+     * writer blocked on it.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->transport_exited = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _mysock_signal_data_ready(ctx, &ctx->writer_cond);
+
     /* force final myread() to return 0 bytes (this should have been done
      * by the transport layer already in response to the peer's FIN).
      */
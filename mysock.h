@@ -43,6 +43,122 @@ extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+extern int mysetnonblocking(mysocket_t sd, bool_t nonblocking);
+
+/* per-connection transport statistics, as returned by mygetinfo().  times
+ * are in microseconds; windows and amounts of data are in bytes.  anything
+ * the transport layer doesn't track reads as zero.
+ */
+struct stcp_info
+{
+    /* reported by the transport layer */
+    uint32_t stcpi_srtt;            /* smoothed round-trip time */
+    uint32_t stcpi_rttvar;          /* round-trip time variance */
+    uint32_t stcpi_rto;             /* retransmission timeout */
+    uint32_t stcpi_cwnd;            /* congestion window */
+    uint32_t stcpi_ssthresh;        /* slow start threshold */
+    uint32_t stcpi_bytes_in_flight; /* sent but not yet acknowledged */
+    uint64_t stcpi_retransmits;     /* segments retransmitted */
+    uint64_t stcpi_dup_acks;        /* duplicate ACKs received */
+    uint64_t stcpi_out_of_order;    /* out-of-order segments received */
+
+    /* maintained by the mysocket layer */
+    uint64_t stcpi_segs_sent;
+    uint64_t stcpi_segs_rcvd;
+    uint64_t stcpi_bytes_sent;      /* payload only, excluding headers */
+    uint64_t stcpi_bytes_rcvd;
+    uint32_t stcpi_peer_window;     /* last window advertised by peer */
+    uint32_t stcpi_rcv_queue;       /* bytes from peer not yet processed */
+    uint32_t stcpi_snd_queue;       /* bytes from mywrite() not yet sent */
+};
+
+extern int mygetinfo(mysocket_t sd, struct stcp_info *info);
+
+/* options for mysetsockopt()/mygetsockopt().  all values are ints.
+ * transport parameters (everything but MYSO_SNDBUF and MYSO_CHECKSUM) are
+ * sampled when the connection starts, so they should be set before
+ * myconnect(), or on the listening mysocket before connections arrive;
+ * sockets returned by myaccept() inherit the listener's options.
+ */
+enum
+{
+    MYSO_SNDBUF,        /* limit on data queued by mywrite(), in bytes */
+    MYSO_RCVBUF,        /* receive window advertised to peer, in bytes */
+    MYSO_NODELAY,       /* send each mywrite() chunk as soon as possible */
+    MYSO_CORK,          /* hold back partial segments for more data */
+    MYSO_CONGESTION,    /* congestion control algorithm (MYSOCK_CC_*) */
+    MYSO_INITCWND,      /* initial congestion window, in segments */
+                        /* (neither is supported yet, as the transport is
+                         * stop-and-wait; both fail with ENOPROTOOPT) */
+    MYSO_MSS,           /* maximum segment payload, in bytes */
+    MYSO_DELACK_TIMEOUT,/* delayed ACK timeout, in microseconds (0=off) */
+    MYSO_CHECKSUM       /* checksum mode (MYSOCK_CSUM_*) */
+};
+
+/* MYSO_CONGESTION values */
+enum
+{
+    MYSOCK_CC_NONE,     /* fixed window */
+    MYSOCK_CC_RENO
+};
+
+/* MYSO_CHECKSUM values */
+enum
+{
+    MYSOCK_CSUM_FULL,   /* compute on send, verify on receive */
+    MYSOCK_CSUM_NONE    /* send zero checksums, as UDP permits, and don't
+                         * verify; both ends must use the same mode */
+};
+
+extern int mysetsockopt(mysocket_t sd, int optname,
+                        const void *optval, socklen_t optlen);
+extern int mygetsockopt(mysocket_t sd, int optname,
+                        void *optval, socklen_t *optlen);
+
+/* write a binary trace of every STCP segment sent or received (by all
+ * mysockets) to the given file, replacing any trace in progress, or stop
+ * tracing if filename is NULL.  tracing is off unless the STCP_TRACE
+ * environment variable names a file; use stcp_trace_dump to read it.
+ */
+extern int mysettrace(const char *filename);
+
+/* capture every STCP segment sent or received, wrapped in synthesized IPv4
+ * headers, to a pcapng file that Wireshark or tcptrace can read; or stop
+ * capturing if filename is NULL.  capture is off unless the STCP_PCAP
+ * environment variable names a file.  the file is trimmed to its final
+ * length when capture stops or the application exits.
+ */
+extern int mysetcapture(const char *filename);
+
+/* emulate an impaired network path for connections started after this
+ * call:  loss (uniform or bursty), duplication, reordering, and delay with
+ * jitter, as described by spec--e.g. "loss=1%,delay=20ms,jitter=5ms,seed=7"
+ * (see network_emu.h for the full syntax).  this replaces the setting
+ * taken from the STCP_NETEM environment variable; a NULL spec restores the
+ * default, where only unreliable mysockets are impaired.  returns 0, or -1
+ * with errno set to EINVAL if spec is malformed.
+ */
+extern int mysetnetem(const char *spec);
+
+/* per-connection statistics from the network emulator, as returned by
+ * mygetnetemstats().  these cover the packets the connection has sent;
+ * they are all zero if the connection's path isn't impaired.  times are in
+ * microseconds.
+ */
+struct stcp_netem_stats
+{
+    uint64_t ns_pkts_sent;
+    uint64_t ns_pkts_lost;          /* by the loss model */
+    uint64_t ns_pkts_dropped;       /* by the link's queue (drop-tail/AQM) */
+    uint64_t ns_pkts_delivered;
+    uint64_t ns_bytes_delivered;    /* payload only, excluding headers */
+    uint64_t ns_goodput;            /* payload delivered, bits per second */
+    uint32_t ns_qdelay_avg;         /* time spent queued for the link */
+    uint32_t ns_qdelay_max;
+};
+
+extern int mygetnetemstats(mysocket_t sd, struct stcp_netem_stats *stats);
+
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
@@ -12,6 +12,10 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "connection_demux.h"
+#include "transport.h"  /* for STCP_MSS */
+#include "mysock_trace.h"
+#include "mysock_pcap.h"
+#include "network_emu.h"
 
 
 /* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
@@ -169,15 +173,14 @@ int myclose(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    _mysock_signal_data_ready(ctx, &ctx->transport_cond);
 
     /* block until STCP thread exits */
     if (ctx->transport_thread_started)
     {
         assert(!ctx->listening);
         assert(ctx->is_active || ctx->listen_sd != -1);
-        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
-        ctx->transport_thread_started = FALSE;
+        _mysock_join_transport(ctx);
     }
 
     _network_stop_recv_thread(ctx);
@@ -195,18 +198,71 @@ int myclose(mysocket_t sd)
     return 0;
 }
 
+/* queue data for the transport layer.  at most opts.sndbuf bytes may be
+ * waiting for the transport at any time; beyond that, mywrite() blocks until
+ * the transport takes more data, or, for a nonblocking mysocket, returns the
+ * number of bytes queued so far (failing with EAGAIN if that's zero).
+ */
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    const char *cbuf = (const char *) buf;
+    size_t bytes_queued = 0;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    while (bytes_queued < buf_len)
+    {
+        size_t space = 0, chunk_len;
+        bool_t exited;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        for (;;)
+        {
+            exited = ctx->transport_exited;
+            if (ctx->app_recv_queue.bytes < ctx->opts.sndbuf)
+                space = ctx->opts.sndbuf - ctx->app_recv_queue.bytes;
+
+            if (space > 0 || exited || ctx->nonblocking)
+                break;
+
+            ++ctx->writers_waiting;
+            (void) _mysock_wait_data_ready(ctx, &ctx->writer_cond, NULL);
+            --ctx->writers_waiting;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        if (exited || space == 0)
+        {
+            if (bytes_queued > 0)
+                break;
+            MYSOCK_ERROR_EXIT(exited ? EPIPE : EAGAIN);
+        }
+
+        /* only the transport dequeues, so space can't shrink under us */
+        chunk_len = MIN(space, buf_len - bytes_queued);
+        _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue,
+                               cbuf + bytes_queued, chunk_len);
+        bytes_queued += chunk_len;
+    }
+
+    return bytes_queued;
+}
+
+/* select blocking (the default) or nonblocking mywrite() behaviour */
+int mysetnonblocking(mysocket_t sd, bool_t nonblocking)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->nonblocking = nonblocking;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
 }
 
 int myread(mysocket_t sd, void *buf, size_t buf_len)
@@ -228,10 +284,168 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
     }
+    else if ((size_t) len < buf_len)
+    {
+        /* the transport passes data up a segment at a time; take whatever
+         * else has already arrived.
+         */
+        len += _mysock_dequeue_more(ctx, &ctx->app_send_queue,
+                                    (char *) buf + len, buf_len - len);
+    }
 
     return len;
 }
 
+/* set a mysocket option; see mysock.h for the options available */
+int mysetsockopt(mysocket_t sd, int optname,
+                 const void *optval, socklen_t optlen)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    stcp_options_t *opts;
+    int val;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(optval != NULL, EFAULT);
+    MYSOCK_CHECK(optlen == sizeof(int), EINVAL);
+
+    val  = *(const int *) optval;
+    opts = &ctx->opts;
+
+    /* sndbuf is read by mywrite(), under data_ready_lock */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    switch (optname)
+    {
+    case MYSO_SNDBUF:
+    case MYSO_RCVBUF:
+        if (val <= 0)
+            goto invalid;
+        *((optname == MYSO_SNDBUF) ? &opts->sndbuf : &opts->rcvbuf) = val;
+        break;
+
+    case MYSO_NODELAY:
+        opts->nodelay = (val != 0);
+        break;
+
+    case MYSO_CORK:
+        opts->cork = (val != 0);
+        break;
+
+    case MYSO_MSS:
+        if (val <= 0 || val > STCP_MSS)
+            goto invalid;
+        opts->mss = val;
+        break;
+
+    case MYSO_DELACK_TIMEOUT:
+        if (val < 0)
+            goto invalid;
+        opts->delack_timeout = val;
+        break;
+
+    case MYSO_CHECKSUM:
+        if (val != MYSOCK_CSUM_FULL && val != MYSOCK_CSUM_NONE)
+            goto invalid;
+        opts->checksum = val;
+        break;
+
+    default:
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    /* a larger send buffer may let a blocked writer proceed */
+    if (optname == MYSO_SNDBUF)
+        _mysock_signal_data_ready(ctx, &ctx->writer_cond);
+    return 0;
+
+invalid:
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    MYSOCK_ERROR_EXIT(EINVAL);
+}
+
+int mygetsockopt(mysocket_t sd, int optname, void *optval, socklen_t *optlen)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int val;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(optval != NULL && optlen != NULL, EFAULT);
+    MYSOCK_CHECK(*optlen >= sizeof(int), EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    switch (optname)
+    {
+    case MYSO_SNDBUF:           val = ctx->opts.sndbuf;         break;
+    case MYSO_RCVBUF:           val = ctx->opts.rcvbuf;         break;
+    case MYSO_NODELAY:          val = ctx->opts.nodelay;        break;
+    case MYSO_CORK:             val = ctx->opts.cork;           break;
+    case MYSO_MSS:              val = ctx->opts.mss;            break;
+    case MYSO_DELACK_TIMEOUT:   val = ctx->opts.delack_timeout; break;
+    case MYSO_CHECKSUM:         val = ctx->opts.checksum;       break;
+
+    default:
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    *(int *) optval = val;
+    *optlen = sizeof(int);
+    return 0;
+}
+
+int mysettrace(const char *filename)
+{
+    return _mysock_trace_set_file(filename);
+}
+
+int mysetcapture(const char *filename)
+{
+    return _mysock_pcap_set_file(filename);
+}
+
+int mysetnetem(const char *spec)
+{
+    return _network_emu_set_config(spec);
+}
+
+/* return a snapshot of the network emulator's statistics for the
+ * connection
+ */
+int mygetnetemstats(mysocket_t sd, struct stcp_netem_stats *stats)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(stats != NULL, EFAULT);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    _network_emu_get_stats(&ctx->network_state, stats);
+    return 0;
+}
+
+/* return a snapshot of the connection's transport statistics */
+int mygetinfo(mysocket_t sd, struct stcp_info *info)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(info != NULL, EFAULT);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->info_lock));
+    *info = ctx->info;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->info_lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    info->stcpi_rcv_queue = ctx->network_recv_queue.bytes;
+    info->stcpi_snd_queue = ctx->app_recv_queue.bytes;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return 0;
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
@@ -0,0 +1,82 @@
+/* mysock_buf.c--reference-counted packet buffers */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+
+
+/* maximum number of idle MYSOCK_BUF_SIZE buffers kept for reuse */
+#define MYSOCK_BUF_POOL_MAX 256
+
+static pthread_mutex_t buf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static mysock_buf_t   *buf_pool;
+static unsigned int    buf_pool_len;
+
+
+/* return a buffer with room for at least size bytes, and a reference count
+ * of one.  buffers of up to MYSOCK_BUF_SIZE bytes come from the pool.
+ */
+mysock_buf_t *_mysock_buf_alloc(size_t size)
+{
+    mysock_buf_t *buf = NULL;
+
+    if (size <= MYSOCK_BUF_SIZE)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&buf_pool_lock));
+        if ((buf = buf_pool) != NULL)
+        {
+            buf_pool = buf->next;
+            --buf_pool_len;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&buf_pool_lock));
+
+        size = MYSOCK_BUF_SIZE;
+    }
+
+    if (!buf)
+    {
+        buf = (mysock_buf_t *) malloc(sizeof(mysock_buf_t) + size);
+        assert(buf);
+        buf->size = size;
+    }
+
+    buf->refcnt = 1;
+    buf->next   = NULL;
+    return buf;
+}
+
+/* take an additional reference to buf */
+void _mysock_buf_ref(mysock_buf_t *buf)
+{
+    assert(buf && buf->refcnt > 0);
+    (void) __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* drop a reference to buf (which may be NULL), returning it to the pool or
+ * freeing it once the last reference is gone.
+ */
+void _mysock_buf_release(mysock_buf_t *buf)
+{
+    if (!buf)
+        return;
+
+    assert(buf->refcnt > 0);
+    if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (buf->size == MYSOCK_BUF_SIZE)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&buf_pool_lock));
+        if (buf_pool_len < MYSOCK_BUF_POOL_MAX)
+        {
+            buf->next = buf_pool;
+            buf_pool  = buf;
+            ++buf_pool_len;
+            buf = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&buf_pool_lock));
+    }
+
+    free(buf);
+}
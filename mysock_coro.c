@@ -0,0 +1,348 @@
+/* mysock_coro.c--stackful coroutine runtime for the transport layer */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "mysock_coro.h"
+
+
+typedef enum
+{
+    CORO_RUNNABLE,  /* on the run queue */
+    CORO_RUNNING,   /* currently executing on the scheduler thread */
+    CORO_WAITING,   /* suspended in _mysock_coro_wait() */
+    CORO_DONE       /* start function has returned */
+} coro_state_t;
+
+/* one instance per transport coroutine */
+typedef struct mysock_coro
+{
+    ucontext_t          uc;
+    char               *stack;
+    coro_state_t        state;
+
+    mysock_context_t   *ctx;
+    void             *(*start)(void *args);
+
+    bool_t              wakeup_pending; /* woken while still running */
+    bool_t              timed_out;      /* resumed because deadline passed */
+    bool_t              has_deadline;
+    struct timespec     deadline;
+
+    struct mysock_coro *run_next;       /* run queue linkage */
+    struct mysock_coro *next;           /* list of all coroutines */
+} mysock_coro_t;
+
+
+/* all scheduler state is protected by sched_lock.  the lock is released
+ * while a coroutine runs, and re-acquired by the coroutine before it
+ * switches back to the scheduler (either by yielding or by finishing).
+ */
+static pthread_once_t  sched_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sched_lock;
+static pthread_cond_t  sched_cond;      /* work for the scheduler */
+static pthread_cond_t  done_cond;       /* a coroutine has finished */
+static ucontext_t      sched_uc;
+
+static mysock_coro_t  *run_head, *run_tail;
+static mysock_coro_t  *coro_list;
+
+/* coroutine currently executing; only ever set on the scheduler thread */
+static __thread mysock_coro_t *coro_current;
+
+
+static void _coro_sched_init(void);
+static void *coro_scheduler_func(void *arg);
+static void coro_trampoline(void);
+static void _coro_make_runnable(mysock_coro_t *coro);
+static bool_t _coro_expire_deadlines(struct timespec *next_deadline);
+static int _coro_timespec_cmp(const struct timespec *a,
+                              const struct timespec *b);
+
+
+/* start a new coroutine for the given mysocket context */
+int _mysock_coro_spawn(mysock_context_t *ctx, void *(*start)(void *args))
+{
+    mysock_coro_t *coro;
+
+    assert(ctx && start);
+    PTHREAD_CALL(pthread_once(&sched_once, _coro_sched_init));
+
+    coro = (mysock_coro_t *) calloc(1, sizeof(mysock_coro_t));
+    assert(coro);
+
+    if (!(coro->stack = (char *) malloc(MYSOCK_CORO_STACK_SIZE)))
+    {
+        free(coro);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    coro->ctx   = ctx;
+    coro->start = start;
+
+    if (getcontext(&coro->uc) < 0)
+    {
+        assert(0);
+        free(coro->stack);
+        free(coro);
+        return -1;
+    }
+
+    coro->uc.uc_stack.ss_sp   = coro->stack;
+    coro->uc.uc_stack.ss_size = MYSOCK_CORO_STACK_SIZE;
+    coro->uc.uc_link          = &sched_uc;
+    makecontext(&coro->uc, coro_trampoline, 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    coro->next = coro_list;
+    coro_list = coro;
+    ctx->transport_coro = coro;
+    _coro_make_runnable(coro);
+    PTHREAD_CALL(pthread_mutex_unlock(&sched_lock));
+
+    return 0;
+}
+
+/* wait for the context's coroutine to finish, and free it */
+void _mysock_coro_join(mysock_context_t *ctx)
+{
+    mysock_coro_t *coro, **prev;
+
+    assert(ctx);
+    assert(!_mysock_coro_active());
+
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    coro = ctx->transport_coro;
+    assert(coro);
+
+    while (coro->state != CORO_DONE)
+        PTHREAD_CALL(pthread_cond_wait(&done_cond, &sched_lock));
+
+    for (prev = &coro_list; *prev != coro; prev = &(*prev)->next)
+        assert(*prev);
+    *prev = coro->next;
+    ctx->transport_coro = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&sched_lock));
+
+    /* the scheduler has already released the stack */
+    assert(!coro->stack);
+    memset(coro, 0, sizeof(*coro));
+    free(coro);
+}
+
+bool_t _mysock_coro_active(void)
+{
+    return coro_current != NULL;
+}
+
+/* yield to the scheduler until woken, or until abstime passes */
+int _mysock_coro_wait(mysock_context_t *ctx, const struct timespec *abstime)
+{
+    mysock_coro_t *coro = coro_current;
+
+    assert(coro && coro->ctx == ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    assert(coro->state == CORO_RUNNING);
+
+    if (coro->wakeup_pending)
+    {
+        /* something happened between our caller checking its queues and
+         * getting here; let it look again.
+         */
+        coro->wakeup_pending = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&sched_lock));
+        return 0;
+    }
+
+    coro->state        = CORO_WAITING;
+    coro->timed_out    = FALSE;
+    coro->has_deadline = (abstime != NULL);
+    if (abstime)
+        coro->deadline = *abstime;
+
+    /* the scheduler resumes after its own swapcontext() with sched_lock
+     * still held; it drops the lock again before switching back to us.
+     */
+    if (swapcontext(&coro->uc, &sched_uc) < 0)
+    {
+        assert(0);
+        abort();
+    }
+
+    assert(coro == coro_current);
+    return coro->timed_out ? ETIMEDOUT : 0;
+}
+
+void _mysock_coro_wake(mysock_context_t *ctx)
+{
+    mysock_coro_t *coro;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_once(&sched_once, _coro_sched_init));
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    if ((coro = ctx->transport_coro) != NULL)
+    {
+        switch (coro->state)
+        {
+        case CORO_WAITING:
+            _coro_make_runnable(coro);
+            break;
+
+        case CORO_RUNNING:
+            coro->wakeup_pending = TRUE;
+            break;
+
+        default:
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&sched_lock));
+}
+
+
+static void _coro_sched_init(void)
+{
+    PTHREAD_CALL(pthread_mutex_init(&sched_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&sched_cond, NULL));
+    PTHREAD_CALL(pthread_cond_init(&done_cond, NULL));
+
+    (void) _mysock_create_thread(coro_scheduler_func, NULL, TRUE);
+}
+
+/* the scheduler thread.  this runs coroutines off the run queue until
+ * each yields or finishes, and sleeps until the next wakeup or deadline
+ * when there's nothing to do.
+ */
+static void *coro_scheduler_func(void *arg)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    for (;;)
+    {
+        mysock_coro_t *coro;
+        struct timespec next_deadline;
+        bool_t have_deadline;
+
+        have_deadline = _coro_expire_deadlines(&next_deadline);
+
+        if (!(coro = run_head))
+        {
+            if (have_deadline)
+            {
+                int rc = pthread_cond_timedwait(&sched_cond, &sched_lock,
+                                                &next_deadline);
+                assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+            }
+            else
+            {
+                PTHREAD_CALL(pthread_cond_wait(&sched_cond, &sched_lock));
+            }
+            continue;
+        }
+
+        if (!(run_head = coro->run_next))
+            run_tail = NULL;
+        coro->run_next = NULL;
+
+        coro->state = CORO_RUNNING;
+        coro_current = coro;
+        PTHREAD_CALL(pthread_mutex_unlock(&sched_lock));
+
+        if (swapcontext(&sched_uc, &coro->uc) < 0)
+        {
+            assert(0);
+            abort();
+        }
+
+        /* back with sched_lock held */
+        coro_current = NULL;
+        if (coro->state == CORO_DONE)
+        {
+            free(coro->stack);
+            coro->stack = NULL;
+            PTHREAD_CALL(pthread_cond_broadcast(&done_cond));
+        }
+    }
+
+    return NULL;
+}
+
+/* entry point of each coroutine; returns to sched_uc via uc_link */
+static void coro_trampoline(void)
+{
+    mysock_coro_t *coro = coro_current;
+
+    assert(coro && coro->start);
+    (void) coro->start(coro->ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sched_lock));
+    coro->state = CORO_DONE;
+}
+
+/* assumes sched_lock is held */
+static void _coro_make_runnable(mysock_coro_t *coro)
+{
+    assert(coro && !coro->run_next);
+
+    coro->state = CORO_RUNNABLE;
+    coro->wakeup_pending = FALSE;
+    if (run_tail)
+        run_tail->run_next = coro;
+    else
+        run_head = coro;
+    run_tail = coro;
+
+    PTHREAD_CALL(pthread_cond_signal(&sched_cond));
+}
+
+/* move any waiting coroutines whose deadline has passed onto the run queue.
+ * returns TRUE and fills in next_deadline if any coroutine is still
+ * waiting with a deadline.  assumes sched_lock is held.
+ */
+static bool_t _coro_expire_deadlines(struct timespec *next_deadline)
+{
+    mysock_coro_t *coro;
+    struct timespec now;
+    bool_t found = FALSE;
+
+    assert(next_deadline);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (coro = coro_list; coro; coro = coro->next)
+    {
+        if (coro->state != CORO_WAITING || !coro->has_deadline)
+            continue;
+
+        if (_coro_timespec_cmp(&coro->deadline, &now) <= 0)
+        {
+            coro->timed_out = TRUE;
+            _coro_make_runnable(coro);
+        }
+        else if (!found ||
+                 _coro_timespec_cmp(&coro->deadline, next_deadline) < 0)
+        {
+            *next_deadline = coro->deadline;
+            found = TRUE;
+        }
+    }
+
+    return found;
+}
+
+static int _coro_timespec_cmp(const struct timespec *a,
+                              const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return (a->tv_sec < b->tv_sec) ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+    return 0;
+}
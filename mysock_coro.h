@@ -0,0 +1,55 @@
+/* mysock_coro.h--stackful coroutine runtime for the transport layer.
+ * this is an internal header, used only by the mysocket layer.
+ *
+ * when built with -DMYSOCK_COROUTINES, each transport_init() runs as a
+ * coroutine on a small private stack rather than in its own pthread.  all
+ * coroutines are multiplexed onto a single scheduler thread;
+ * stcp_wait_for_event() yields back to the scheduler instead of blocking,
+ * so the transport code keeps its straight-line structure while an idle
+ * connection costs only its stack.
+ */
+
+#ifndef __MYSOCK_CORO_H__
+#define __MYSOCK_CORO_H__
+
+#include <time.h>
+#include "mysock.h"
+
+/* per-coroutine stack size.  the transport layer keeps its large buffers
+ * on the heap, so this only needs to cover the stub code's stack usage
+ * (a packet buffer or two, plus libc).
+ */
+#ifndef MYSOCK_CORO_STACK_SIZE
+#define MYSOCK_CORO_STACK_SIZE (64 * 1024)
+#endif
+
+struct mysock_context;
+struct mysock_coro;
+
+/* start a new coroutine running start(ctx) on the scheduler thread.
+ * returns 0 on success, -1 on failure.
+ */
+int _mysock_coro_spawn(struct mysock_context *ctx,
+                       void *(*start)(void *args));
+
+/* block until the coroutine associated with ctx has finished, then release
+ * it.  must not be called from a coroutine.
+ */
+void _mysock_coro_join(struct mysock_context *ctx);
+
+/* TRUE if the caller is running inside a transport coroutine */
+bool_t _mysock_coro_active(void);
+
+/* suspend the current coroutine until _mysock_coro_wake() is called for
+ * ctx, or until abstime passes (if non-NULL).  returns 0 if woken, or
+ * ETIMEDOUT if the deadline passed first.
+ */
+int _mysock_coro_wait(struct mysock_context *ctx,
+                      const struct timespec *abstime);
+
+/* make the coroutine associated with ctx (if any) runnable.  this is safe
+ * to call from any thread, and is a no-op for thread-based contexts.
+ */
+void _mysock_coro_wake(struct mysock_context *ctx);
+
+#endif  /* __MYSOCK_CORO_H__ */
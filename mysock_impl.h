@@ -12,7 +12,9 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "mysock.h"
+#include "stcp_api.h"
 #include "network_io.h"
 
 #ifdef __GNUC__
@@ -48,11 +50,29 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
+/* reference-counted packet buffer.  the network receive thread reads each
+ * packet into one of these; the transport layer can then borrow it from
+ * network_recv_queue, and pass slices of it up to app_send_queue, without
+ * copying.  buffers return to a pool once the last reference is dropped.
+ */
+#define MYSOCK_BUF_SIZE MAX_IP_PAYLOAD_LEN
+
+typedef struct mysock_buf
+{
+    int                refcnt;
+    size_t             size;        /* capacity of data[] */
+    struct mysock_buf *next;        /* pool linkage */
+    char               data[];
+} mysock_buf_t;
+
+/* packet/buffer queue.  each node holds a reference to the buffer that
+ * contains its data (buf is NULL for a zero-length node).
+ */
 typedef struct packet_queue_node
 {
     char                     *data;
     size_t                    data_len;
+    mysock_buf_t             *buf;
     struct packet_queue_node *next;
 } packet_queue_node_t;
 
@@ -60,8 +80,16 @@ typedef struct
 {
     packet_queue_node_t *head;
     packet_queue_node_t *tail;
+    size_t               bytes;     /* total data_len of queued nodes */
+    pthread_cond_t      *ready_cond;    /* signaled when queue fills */
 } packet_queue_t;
 
+/* option defaults.  MYSOCK_DEFAULT_SNDBUF limits bytes queued by mywrite()
+ * but not yet taken by the transport layer.
+ */
+#define MYSOCK_DEFAULT_SNDBUF (64 * 1024)
+#define MYSOCK_DEFAULT_RCVBUF 3072
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -94,15 +122,44 @@ typedef struct mysock_context
     bool_t          blocking;
     int             stcp_errno;
 
-    /* STCP thread */
+    /* STCP thread (or coroutine, if built with MYSOCK_COROUTINES) */
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
-
-    /* is data ready from either network or the app? */
-    pthread_cond_t  data_ready_cond;
+    struct mysock_coro *transport_coro;
+
+    /* is data ready from either network or the app?  the queues below are
+     * protected by data_ready_lock.  each consumer waits on its own
+     * condition variable, which is only signaled when one of its queues
+     * goes from empty to non-empty (or something else it waits for
+     * happens), so packets for the transport don't wake the application
+     * and vice versa.
+     */
     pthread_mutex_t data_ready_lock;
+    pthread_cond_t  transport_cond;     /* network_recv_queue, app_recv_queue,
+                                         * close_requested */
+    pthread_cond_t  reader_cond;        /* app_send_queue (myread()) */
+    pthread_cond_t  writer_cond;        /* app_recv_queue space (mywrite()) */
     bool_t          close_requested;    /* myclose() called by app? */
     bool_t          eof;                /* true once peer finishes writing */
+    bool_t          transport_exited;   /* transport_init() has returned */
+
+    /* options set with mysetsockopt().  mywrite() blocks (or fails with
+     * EAGAIN if nonblocking) once opts.sndbuf bytes are queued.
+     */
+    stcp_options_t  opts;
+    bool_t          nonblocking;
+    unsigned int    writers_waiting;    /* mywrite() calls waiting for space */
+
+    /* the TCP header fields filled in for the STCP layer on each segment
+     * it sends (see stcp_api.c), worked out once the local port is known
+     */
+    uint16_t        tx_sport;       /* network byte order */
+    uint16_t        tx_dport;       /* network byte order */
+    bool_t          tx_header_valid;
+
+    /* statistics returned by mygetinfo() */
+    pthread_mutex_t  info_lock;
+    struct stcp_info info;
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
@@ -124,6 +181,14 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
 int _mysock_wait_for_connection(mysock_context_t *ctx);
 
+int _mysock_wait_data_ready(mysock_context_t      *ctx,
+                            pthread_cond_t        *cond,
+                            const struct timespec *abstime);
+
+void _mysock_signal_data_ready(mysock_context_t *ctx, pthread_cond_t *cond);
+
+void _mysock_join_transport(mysock_context_t *ctx);
+
 void _mysock_free_context(mysock_context_t *ctx);
 
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
@@ -137,6 +202,36 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+void _mysock_enqueue_refs(mysock_context_t   *ctx,
+                          packet_queue_t     *pq,
+                          mysock_buf_t *const *bufs,
+                          const struct iovec *slices,
+                          int                 count);
+
+size_t _mysock_dequeue_ref(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           mysock_buf_t    **buf,
+                           void            **data);
+
+int _mysock_dequeue_refs(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         mysock_buf_t    **bufs,
+                         void            **data,
+                         size_t           *lens,
+                         int               max_count);
+
+size_t _mysock_dequeue_more(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len);
+
+/* mysock_buf.c */
+mysock_buf_t *_mysock_buf_alloc(size_t size);
+
+void _mysock_buf_ref(mysock_buf_t *buf);
+
+void _mysock_buf_release(mysock_buf_t *buf);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
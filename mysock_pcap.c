@@ -0,0 +1,367 @@
+/* mysock_pcap.c--pcapng capture of STCP traffic */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "mysock_pcap.h"
+#include "mysock_trace.h"
+
+
+/* the capture file is extended (and remapped) this much at a time */
+#define PCAP_MAP_CHUNK (1024 * 1024)
+
+#define PCAP_PAD4(x) (((x) + 3) & ~(size_t) 3)
+
+/* pcapng block types and constants */
+#define PCAPNG_SHB_TYPE     0x0A0D0D0A
+#define PCAPNG_IDB_TYPE     0x00000001
+#define PCAPNG_EPB_TYPE     0x00000006
+#define PCAPNG_BYTE_ORDER   0x1A2B3C4D
+#define PCAPNG_LINKTYPE_RAW 101         /* raw IPv4/IPv6, no link header */
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_FLAG_INBOUND  0x1
+#define PCAPNG_FLAG_OUTBOUND 0x2
+
+/* section header block, without options */
+typedef struct
+{
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t byte_order;
+    uint16_t major, minor;
+    uint32_t section_len[2];    /* 64-bit; all ones for "unknown" */
+    uint32_t total_len2;
+} pcapng_shb_t;
+
+/* interface description block, without options.  timestamps are in the
+ * default resolution of microseconds.
+ */
+typedef struct
+{
+    uint32_t type;
+    uint32_t total_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint32_t total_len2;
+} pcapng_idb_t;
+
+/* start of an enhanced packet block; packet data, options and the trailing
+ * length follow.
+ */
+typedef struct
+{
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t interface_id;
+    uint32_t ts_high, ts_low;
+    uint32_t cap_len;
+    uint32_t orig_len;
+} pcapng_epb_t;
+
+/* EPB options: the direction flag, then end-of-options, then the trailing
+ * block length.
+ */
+typedef struct
+{
+    uint16_t flags_code, flags_len;
+    uint32_t flags;
+    uint16_t end_code, end_len;
+    uint32_t total_len2;
+} pcapng_epb_trailer_t;
+
+/* synthesized IPv4 header */
+typedef struct
+{
+    uint8_t  ver_ihl;
+    uint8_t  tos;
+    uint16_t total_len;
+    uint16_t id;
+    uint16_t frag_off;
+    uint8_t  ttl;
+    uint8_t  protocol;
+    uint16_t checksum;
+    uint32_t src, dst;
+} pcap_iphdr_t;
+
+
+static pthread_once_t  pcap_once = PTHREAD_ONCE_INIT;
+
+/* pcap_lock protects all the writer state below */
+static pthread_mutex_t pcap_lock;
+static int             pcap_fd = -1;
+static char           *pcap_map;
+static size_t          pcap_map_len;
+static size_t          pcap_offset;     /* end of the data written so far */
+static uint16_t        pcap_ip_id;
+
+/* checked without the lock on every packet */
+static int             pcap_enabled;
+
+
+static void _pcap_init(void);
+static void _pcap_atexit(void);
+static int  _pcap_open(const char *filename);
+static void _pcap_close(void);
+static void *_pcap_reserve(size_t len);
+static uint16_t _pcap_ip_checksum(const void *hdr, size_t len);
+
+
+void _mysock_pcap_packet(mysock_context_t *ctx, int dir,
+                         const struct iovec *iov, int iovcnt)
+{
+    network_context_t    *net_ctx;
+    pcap_iphdr_t          ip;
+    pcapng_epb_t         *epb;
+    pcapng_epb_trailer_t *trailer;
+    uint32_t              local_ip = 0, peer_ip = 0;
+    size_t                len = 0, cap_len, block_len;
+    struct timeval        now;
+    uint64_t              ts;
+    char                 *p;
+    int                   k;
+
+    PTHREAD_CALL(pthread_once(&pcap_once, _pcap_init));
+    if (!__atomic_load_n(&pcap_enabled, __ATOMIC_RELAXED))
+        return;
+
+    assert(ctx && iov && iovcnt > 0);
+    net_ctx = &ctx->network_state;
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+
+    /* use the same addresses as the checksum, so it verifies in Wireshark */
+    if (net_ctx->peer_addr_valid && net_ctx->peer_addr.sa_family == AF_INET)
+    {
+        peer_ip  = ((struct sockaddr_in *) &net_ctx->peer_addr)->
+                       sin_addr.s_addr;
+        local_ip = _network_get_local_addr(net_ctx);
+    }
+
+    gettimeofday(&now, NULL);
+    ts = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+
+    cap_len   = sizeof(ip) + len;
+    block_len = sizeof(*epb) + PCAP_PAD4(cap_len) + sizeof(*trailer);
+
+    memset(&ip, 0, sizeof(ip));
+    ip.ver_ihl   = 0x45;
+    ip.total_len = htons((uint16_t) cap_len);
+    ip.frag_off  = htons(0x4000);   /* DF */
+    ip.ttl       = 64;
+    ip.protocol  = IPPROTO_TCP;
+    ip.src       = (dir == TRACE_SEND) ? local_ip : peer_ip;
+    ip.dst       = (dir == TRACE_SEND) ? peer_ip : local_ip;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pcap_lock));
+    if (pcap_fd < 0 || !(p = (char *) _pcap_reserve(block_len)))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&pcap_lock));
+        return;
+    }
+
+    ip.id       = htons(pcap_ip_id++);
+    ip.checksum = _pcap_ip_checksum(&ip, sizeof(ip));
+
+    /* build the block in place in the mapped file */
+    epb = (pcapng_epb_t *) p;
+    epb->type         = PCAPNG_EPB_TYPE;
+    epb->total_len    = block_len;
+    epb->interface_id = 0;
+    epb->ts_high      = (uint32_t) (ts >> 32);
+    epb->ts_low       = (uint32_t) ts;
+    epb->cap_len      = cap_len;
+    epb->orig_len     = cap_len;
+    p += sizeof(*epb);
+
+    memcpy(p, &ip, sizeof(ip));
+    p += sizeof(ip);
+    for (k = 0; k < iovcnt; ++k)
+    {
+        memcpy(p, iov[k].iov_base, iov[k].iov_len);
+        p += iov[k].iov_len;
+    }
+    memset(p, 0, PCAP_PAD4(cap_len) - cap_len);
+    p += PCAP_PAD4(cap_len) - cap_len;
+
+    trailer = (pcapng_epb_trailer_t *) p;
+    trailer->flags_code = PCAPNG_OPT_EPB_FLAGS;
+    trailer->flags_len  = sizeof(trailer->flags);
+    trailer->flags      = (dir == TRACE_SEND) ?
+                          PCAPNG_FLAG_OUTBOUND : PCAPNG_FLAG_INBOUND;
+    trailer->end_code   = 0;
+    trailer->end_len    = 0;
+    trailer->total_len2 = block_len;
+    PTHREAD_CALL(pthread_mutex_unlock(&pcap_lock));
+}
+
+int _mysock_pcap_set_file(const char *filename)
+{
+    int rc = 0;
+
+    PTHREAD_CALL(pthread_once(&pcap_once, _pcap_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&pcap_lock));
+    _pcap_close();
+    if (filename)
+        rc = _pcap_open(filename);
+    PTHREAD_CALL(pthread_mutex_unlock(&pcap_lock));
+
+    return rc;
+}
+
+
+static void _pcap_init(void)
+{
+    const char *filename;
+
+    PTHREAD_CALL(pthread_mutex_init(&pcap_lock, NULL));
+
+    if ((filename = getenv("STCP_PCAP")) != NULL && *filename)
+    {
+        if (_pcap_open(filename) < 0)
+            perror(filename);
+    }
+}
+
+static void _pcap_atexit(void)
+{
+    (void) _mysock_pcap_set_file(NULL);
+}
+
+/* create the capture file and write the section header and interface
+ * description.  assumes pcap_lock is held (or that we're initialising).
+ */
+static int _pcap_open(const char *filename)
+{
+    static bool_t registered_atexit = FALSE;
+    pcapng_shb_t *shb;
+    pcapng_idb_t *idb;
+
+    assert(filename && pcap_fd < 0);
+
+    if ((pcap_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    pcap_map     = NULL;
+    pcap_map_len = 0;
+    pcap_offset  = 0;
+
+    if (!(shb = (pcapng_shb_t *) _pcap_reserve(sizeof(*shb) + sizeof(*idb))))
+    {
+        int err = errno;
+        close(pcap_fd);
+        pcap_fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    shb->type        = PCAPNG_SHB_TYPE;
+    shb->total_len   = sizeof(*shb);
+    shb->byte_order  = PCAPNG_BYTE_ORDER;
+    shb->major       = 1;
+    shb->minor       = 0;
+    shb->section_len[0] = shb->section_len[1] = 0xffffffff;
+    shb->total_len2  = sizeof(*shb);
+
+    idb = (pcapng_idb_t *) (shb + 1);
+    idb->type        = PCAPNG_IDB_TYPE;
+    idb->total_len   = sizeof(*idb);
+    idb->linktype    = PCAPNG_LINKTYPE_RAW;
+    idb->reserved    = 0;
+    idb->snaplen     = 65535;
+    idb->total_len2  = sizeof(*idb);
+
+    if (!registered_atexit)
+    {
+        /* trim the file to the data actually written when we exit */
+        (void) atexit(_pcap_atexit);
+        registered_atexit = TRUE;
+    }
+
+    __atomic_store_n(&pcap_enabled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* unmap the capture file and trim it to the data written.  assumes
+ * pcap_lock is held.
+ */
+static void _pcap_close(void)
+{
+    __atomic_store_n(&pcap_enabled, 0, __ATOMIC_RELAXED);
+
+    if (pcap_fd < 0)
+        return;
+
+    if (pcap_map)
+        (void) munmap(pcap_map, pcap_map_len);
+    if (ftruncate(pcap_fd, pcap_offset) < 0)
+        perror("ftruncate (pcap)");
+    (void) close(pcap_fd);
+
+    pcap_fd      = -1;
+    pcap_map     = NULL;
+    pcap_map_len = 0;
+    pcap_offset  = 0;
+}
+
+/* return a pointer to len bytes at the end of the capture file, growing
+ * the file and its mapping if needed, or NULL on error.  assumes pcap_lock
+ * is held.
+ */
+static void *_pcap_reserve(size_t len)
+{
+    void *p;
+
+    assert(pcap_fd >= 0 && !(len & 3));
+
+    if (pcap_offset + len > pcap_map_len)
+    {
+        size_t new_len = pcap_map_len;
+        char  *new_map;
+
+        while (pcap_offset + len > new_len)
+            new_len += PCAP_MAP_CHUNK;
+
+        if (ftruncate(pcap_fd, new_len) < 0)
+            return NULL;
+
+        new_map = (char *) mmap(NULL, new_len, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, pcap_fd, 0);
+        if (new_map == (char *) MAP_FAILED)
+            return NULL;
+
+        if (pcap_map)
+            (void) munmap(pcap_map, pcap_map_len);
+        pcap_map     = new_map;
+        pcap_map_len = new_len;
+    }
+
+    p = pcap_map + pcap_offset;
+    pcap_offset += len;
+    return p;
+}
+
+static uint16_t _pcap_ip_checksum(const void *hdr, size_t len)
+{
+    const uint16_t *w = (const uint16_t *) hdr;
+    uint32_t sum = 0;
+
+    assert(!(len & 1));
+    for (; len > 0; len -= 2)
+        sum += *w++;
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
@@ -0,0 +1,30 @@
+/* mysock_pcap.h--pcapng capture of STCP traffic.  this is an internal
+ * header, used only by the mysocket layer.
+ *
+ * each segment sent or received is wrapped in a synthesized IPv4 header
+ * (protocol TCP, using the same addresses as the checksum computation) and
+ * appended to a pcapng file as an enhanced packet block, so captures can
+ * be loaded into Wireshark, tcptrace, etc.
+ */
+
+#ifndef __MYSOCK_PCAP_H__
+#define __MYSOCK_PCAP_H__
+
+#include <sys/uio.h>
+#include "mysock.h"
+
+struct mysock_context;
+
+/* capture an STCP segment, gathered from iovcnt buffers, sent
+ * (dir == TRACE_SEND) or received (TRACE_RECV) on the given mysocket.
+ * this is a no-op unless capture has been enabled.
+ */
+void _mysock_pcap_packet(struct mysock_context *ctx, int dir,
+                         const struct iovec *iov, int iovcnt);
+
+/* start capturing to the given file (replacing any current capture), or
+ * stop capturing if filename is NULL.  returns 0 on success, -1 on error.
+ */
+int _mysock_pcap_set_file(const char *filename);
+
+#endif  /* __MYSOCK_PCAP_H__ */
@@ -0,0 +1,362 @@
+/* mysock_trace.c--asynchronous binary packet trace */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "mysock_trace.h"
+#include "transport.h"
+
+
+/* set LOG_PACKET to TRUE to trace to TRACE_DEFAULT_FILE from the start, as
+ * the STCP_TRACE environment variable (a filename, or empty to disable)
+ * otherwise must.  either way, mysettrace() can change it at any time.
+ */
+#define LOG_PACKET FALSE
+
+/* records per ring; must be a power of two */
+#define TRACE_RING_SIZE 1024
+
+/* how often the writer thread drains the rings (ms) */
+#define TRACE_FLUSH_INTERVAL 10
+
+/* one ring per producing thread.  head is only written by the owning
+ * thread and tail only by the writer, so neither side needs a lock.
+ */
+typedef struct trace_ring
+{
+    trace_record_t     records[TRACE_RING_SIZE];
+    unsigned int       head;    /* next slot to fill */
+    unsigned int       tail;    /* next slot to drain */
+    unsigned int       dropped; /* records lost to a full ring */
+    int                retired; /* owning thread has exited */
+    struct trace_ring *next;
+} trace_ring_t;
+
+
+static pthread_once_t  trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   trace_ring_key;
+
+/* trace_lock protects the ring list and the writer state below.  producers
+ * only take it the first time they trace, to register their ring.
+ */
+static pthread_mutex_t trace_lock;
+static pthread_cond_t  writer_cond;
+static trace_ring_t   *ring_list;
+
+static FILE           *trace_fp;
+static pthread_t       writer_thread;
+static bool_t          writer_running;
+static bool_t          writer_stop;
+
+/* serialises starting and stopping tracing (mysettrace(), and the flush at
+ * exit), which take trace_lock in turn and wait for the writer.
+ */
+static pthread_mutex_t trace_control_lock;
+
+/* checked without the lock on every packet */
+static int             trace_enabled;
+
+static __thread trace_ring_t *my_ring;
+
+
+static void _trace_init(void);
+static int  _trace_start(const char *filename);
+static void _trace_stop(void);
+static void _trace_exit(void);
+static void _trace_retire_ring(void *arg);
+static trace_ring_t *_trace_get_ring(void);
+static void *trace_writer_func(void *arg);
+static void _trace_drain(bool_t write_records);
+
+
+void _mysock_trace_packet(mysocket_t sd, int dir,
+                          const void *packet, size_t len)
+{
+    const struct tcphdr *header = (const struct tcphdr *) packet;
+    trace_ring_t   *ring;
+    trace_record_t *rec;
+    unsigned int    head;
+    struct timeval  now;
+
+    PTHREAD_CALL(pthread_once(&trace_once, _trace_init));
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+        return;
+    if (!packet || len < sizeof(struct tcphdr))
+        return;
+    if (!(ring = _trace_get_ring()))
+        return;
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+        TRACE_RING_SIZE)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+
+    rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    rec->tr_time     = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    rec->tr_seq      = ntohl(header->th_seq);
+    rec->tr_ack      = ntohl(header->th_ack);
+    rec->tr_sport    = ntohs(header->th_sport);
+    rec->tr_dport    = ntohs(header->th_dport);
+    rec->tr_win      = ntohs(header->th_win);
+    rec->tr_len      = (uint16_t) len;
+    rec->tr_flags    = header->th_flags;
+    rec->tr_dir      = (uint8_t) dir;
+    rec->tr_sd       = (int16_t) sd;
+    rec->tr_reserved = 0;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int _mysock_trace_set_file(const char *filename)
+{
+    int rc = 0;
+
+    PTHREAD_CALL(pthread_once(&trace_once, _trace_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_control_lock));
+    _trace_stop();
+    if (filename)
+        rc = _trace_start(filename);
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_control_lock));
+
+    return rc;
+}
+
+
+static void _trace_init(void)
+{
+    const char *filename;
+    char default_file[64];
+
+    PTHREAD_CALL(pthread_mutex_init(&trace_lock, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&trace_control_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&writer_cond, NULL));
+    PTHREAD_CALL(pthread_key_create(&trace_ring_key, _trace_retire_ring));
+
+    if (!(filename = getenv("STCP_TRACE")))
+    {
+        snprintf(default_file, sizeof(default_file),
+                 TRACE_DEFAULT_FILE, (int) getpid());
+        filename = LOG_PACKET ? default_file : "";
+    }
+
+    if (*filename && _trace_start(filename) < 0)
+        perror(filename);
+
+    /* flush whatever is still in the rings when the application exits */
+    (void) atexit(_trace_exit);
+}
+
+/* open the trace file and start the writer thread.  tracing must currently
+ * be stopped.
+ */
+static int _trace_start(const char *filename)
+{
+    trace_file_header_t file_header;
+    FILE *fp;
+
+    assert(filename && !writer_running);
+
+    if (!(fp = fopen(filename, "wb")))
+        return -1;
+
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, TRACE_FILE_MAGIC, sizeof(file_header.magic));
+    file_header.record_len = sizeof(trace_record_t);
+
+    if (fwrite(&file_header, sizeof(file_header), 1, fp) != 1)
+    {
+        int err = errno;
+        fclose(fp);
+        errno = err;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    _trace_drain(FALSE);    /* discard anything left over from before */
+    trace_fp       = fp;
+    writer_stop    = FALSE;
+    writer_running = TRUE;
+    PTHREAD_CALL(pthread_create(&writer_thread, NULL,
+                                trace_writer_func, NULL));
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* stop tracing, flush everything recorded so far, and close the file */
+static void _trace_stop(void)
+{
+    pthread_t thread;
+
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    if (!writer_running)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+        return;
+    }
+
+    writer_stop = TRUE;
+    thread = writer_thread;
+    PTHREAD_CALL(pthread_cond_signal(&writer_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+
+    PTHREAD_CALL(pthread_join(thread, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    writer_running = FALSE;
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+}
+
+/* atexit() handler:  _trace_stop(), after any mysettrace() in progress */
+static void _trace_exit(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&trace_control_lock));
+    _trace_stop();
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_control_lock));
+}
+
+/* thread-specific data destructor: the writer frees the ring once it has
+ * been drained.
+ */
+static void _trace_retire_ring(void *arg)
+{
+    trace_ring_t *ring = (trace_ring_t *) arg;
+
+    assert(ring);
+    __atomic_store_n(&ring->retired, 1, __ATOMIC_RELEASE);
+}
+
+/* return the calling thread's ring, allocating it on first use */
+static trace_ring_t *_trace_get_ring(void)
+{
+    trace_ring_t *ring;
+
+    if ((ring = my_ring) != NULL)
+        return ring;
+
+    if (!(ring = (trace_ring_t *) calloc(1, sizeof(trace_ring_t))))
+        return NULL;
+
+    PTHREAD_CALL(pthread_setspecific(trace_ring_key, ring));
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    ring->next = ring_list;
+    ring_list  = ring;
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+
+    return (my_ring = ring);
+}
+
+/* the writer thread.  this wakes up every TRACE_FLUSH_INTERVAL ms and
+ * appends whatever the producers have recorded to the trace file.
+ */
+static void *trace_writer_func(void *arg)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    for (;;)
+    {
+        struct timespec deadline;
+        int rc;
+
+        _trace_drain(TRUE);
+        fflush(trace_fp);
+
+        if (writer_stop)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_INTERVAL * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        rc = pthread_cond_timedwait(&writer_cond, &trace_lock, &deadline);
+        assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+    }
+
+    fclose(trace_fp);
+    trace_fp = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+    return NULL;
+}
+
+/* empty every ring, writing the records to the trace file if requested,
+ * and free the rings of threads that have exited.  assumes trace_lock is
+ * held.
+ */
+static void _trace_drain(bool_t write_records)
+{
+    trace_ring_t **prev = &ring_list, *ring;
+
+    while ((ring = *prev) != NULL)
+    {
+        /* read retired before head, so a retired ring is known to have
+         * no records beyond the head we drain to.
+         */
+        int          retired = __atomic_load_n(&ring->retired,
+                                               __ATOMIC_ACQUIRE);
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = ring->tail;
+        unsigned int dropped;
+
+        while (tail != head)
+        {
+            unsigned int start = tail & (TRACE_RING_SIZE - 1);
+            unsigned int count = head - tail;
+
+            /* the occupied region may wrap around the end of the ring */
+            if (count > TRACE_RING_SIZE - start)
+                count = TRACE_RING_SIZE - start;
+
+            if (write_records)
+                (void) fwrite(&ring->records[start], sizeof(trace_record_t),
+                              count, trace_fp);
+            tail += count;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0 && write_records)
+        {
+            trace_record_t rec;
+            struct timeval now;
+
+            gettimeofday(&now, NULL);
+            memset(&rec, 0, sizeof(rec));
+            rec.tr_time = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+            rec.tr_dir  = TRACE_DROPPED;
+            rec.tr_seq  = dropped;
+            rec.tr_sd   = -1;
+            (void) fwrite(&rec, sizeof(rec), 1, trace_fp);
+        }
+
+        if (retired)
+        {
+            *prev = ring->next;
+            free(ring);
+        }
+        else
+        {
+            prev = &ring->next;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/* mysock_trace.h--binary packet trace.  this is an internal header, used
+ * by the mysocket layer and by the stcp_trace_dump utility.
+ *
+ * each thread that sends or receives STCP segments appends fixed-size
+ * records to its own lock-free ring; a background writer thread drains all
+ * rings to a single trace file.  the file starts with a trace_file_header_t,
+ * followed by trace_record_t entries in host byte order.
+ */
+
+#ifndef __MYSOCK_TRACE_H__
+#define __MYSOCK_TRACE_H__
+
+#include "mysock.h"
+
+#define TRACE_FILE_MAGIC   "STCPTRC1"
+/* default trace file name; %d is replaced by the process id */
+#define TRACE_DEFAULT_FILE "stcp_trace.%d.bin"
+
+typedef struct
+{
+    char     magic[8];      /* TRACE_FILE_MAGIC, not NUL-terminated */
+    uint32_t record_len;    /* sizeof(trace_record_t) */
+    uint32_t reserved;
+} trace_file_header_t;
+
+/* tr_dir values */
+enum
+{
+    TRACE_SEND    = 0,
+    TRACE_RECV    = 1,
+    TRACE_DROPPED = 2   /* tr_seq records were lost to a full ring */
+};
+
+typedef struct
+{
+    uint64_t tr_time;   /* microseconds since the epoch */
+    uint32_t tr_seq;
+    uint32_t tr_ack;
+    uint16_t tr_sport;
+    uint16_t tr_dport;
+    uint16_t tr_win;
+    uint16_t tr_len;    /* segment length, including header */
+    uint8_t  tr_flags;
+    uint8_t  tr_dir;
+    int16_t  tr_sd;     /* mysocket descriptor */
+    uint32_t tr_reserved;
+} trace_record_t;
+
+
+/* record an STCP segment sent or received on mysocket sd.  this never
+ * blocks; if the calling thread's ring is full, the record is dropped and
+ * counted.
+ */
+void _mysock_trace_packet(mysocket_t sd, int dir,
+                          const void *packet, size_t len);
+
+/* start tracing to the given file (replacing any current trace file), or
+ * stop tracing if filename is NULL.  returns 0 on success, -1 on error.
+ */
+int _mysock_trace_set_file(const char *filename);
+
+#endif  /* __MYSOCK_TRACE_H__ */
@@ -13,72 +13,52 @@
 #include "mysock_impl.h"
 #include "network.h"
 #include "network_io.h"
+#include "network_emu.h"
 #include "transport.h"  /* for dprintf() */
 
 
 
 
-/* helper function for stcp_network_send(); this takes care of unreliable
- * delivery simulation, etc, before passing a packet off to
+/* helper function for stcp_network_sendv(); this passes the packet through
+ * any configured impairments (see network_emu.h) before handing it off to
  * _network_send_packet() for actual transmission over the network.
  */
-int _network_send(mysocket_t sd, const void *buf, size_t len)
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
-    network_context_t *ctx;
 
-    assert(sock_ctx && buf);
-    ctx = &sock_ctx->network_state;
+    assert(sock_ctx && iov && iovcnt > 0);
+    return _network_emu_send(&sock_ctx->network_state, iov, iovcnt);
+}
+
+/* helper function for stcp_network_send_many().  without impairments the
+ * whole batch goes to the network I/O layer in one call; otherwise each
+ * packet takes its chances with _network_sendv() individually.  returns the
+ * total bytes sent, or -1 on error.
+ */
+int _network_send_many(mysocket_t sd, const struct iovec *iov,
+                       const int *iovcnts, int count)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+    int total = 0, k;
 
+    assert(sock_ctx && iov && iovcnts && count > 0);
 
-    if (!ctx->is_reliable)
+    if (_network_emu_bypass(&sock_ctx->network_state))
+        return _network_send_packets(&sock_ctx->network_state,
+                                     iov, iovcnts, count);
+
+    for (k = 0; k < count; ++k)
     {
-        switch (rand_r(&ctx->random_seed) & 0x1f)
-        {
-        case 0:
-            dprintf("====>network_send:dropping the packet\n");
-            /* drop the packet and forget about it. Send nothing */
-            return len;
-
-        case 1:
-            /* send duplicate */
-            dprintf("====>network_send:duplicating the packet\n");
-            _network_send_packet(ctx, buf, len);
-            break;
-
-        case 2:
-            /* store the packet in our queue. Will send it later */
-            dprintf("====>network_send:keeping the packet in our queue\n");
-            assert(len <= sizeof(ctx->copy_buffer));
-            memcpy(&ctx->copy_buffer, buf, len);
-            ctx->copy_buf_len = len;
-            ctx->copied = TRUE;
-            return len;
-
-        case 3:
-            /* forget about this packet, we will send the packet which
-             * we stored sometime back.
-             */
-            if (ctx->copied)
-            {
-                dprintf("====>network_send:sending the packet stored "
-                        "in our queue\n");
-                _network_send_packet(ctx, ctx->copy_buffer, ctx->copy_buf_len);
-            }
-            else
-            {
-                dprintf("====>network_send:duplicating the packet\n");
-                _network_send_packet(ctx, buf, len);
-            }
-            return len;
-
-        default:
-            /* send what we were supposed to send */
-            break;
-        }
+        int rc;
+
+        if ((rc = _network_sendv(sd, iov, iovcnts[k])) < 0)
+            return -1;
+        total += rc;
+        iov += iovcnts[k];
     }
 
-    return _network_send_packet(ctx, buf, len);
+    return total;
 }
 
 /* helper function for stcp_network_recv() */
@@ -94,3 +74,23 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* helper function for stcp_network_recv_borrow() */
+int _network_recv_ref(mysocket_t sd, mysock_buf_t **buf, void **data)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx && buf && data);
+    return _mysock_dequeue_ref(ctx, &ctx->network_recv_queue, buf, data);
+}
+
+
+/* helper function for stcp_network_recv_many() */
+int _network_recv_refs(mysocket_t sd, mysock_buf_t **bufs, void **data,
+                       size_t *lens, int max_count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx && bufs && data && lens);
+    return _mysock_dequeue_refs(ctx, &ctx->network_recv_queue,
+                                bufs, data, lens, max_count);
+}
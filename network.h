@@ -5,10 +5,18 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
-int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+int _network_send_many(mysocket_t sd, const struct iovec *iov,
+                       const int *iovcnts, int count);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+struct mysock_buf;
+int _network_recv_ref(mysocket_t sd, struct mysock_buf **buf, void **data);
+int _network_recv_refs(mysocket_t sd, struct mysock_buf **bufs, void **data,
+                       size_t *lens, int max_count);
+
 #endif  /* __NETWORK_H__ */
 
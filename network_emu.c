@@ -0,0 +1,1269 @@
+/* network_emu.c--network impairment emulation */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "network_emu.h"
+#include "transport.h"  /* for dprintf() */
+
+
+/* impairments used by unreliable mysockets (see mysocket()) when nothing
+ * else has been configured: about one packet in 32 each is dropped,
+ * duplicated, or held back behind the next.
+ */
+#define NETWORK_EMU_UNRELIABLE "seed=0x632a,loss=3.125%,dup=3.125%," \
+                               "reorder=3.125%:1"
+
+/* most packets a connection holds back for reordering at once */
+#define NETWORK_EMU_MAX_HELD 16
+
+/* default length of the queue in front of a rate-limited link */
+#define NETWORK_EMU_DEFAULT_LIMIT 1000
+
+/* RED defaults (thresholds in packets) and queue length averaging weight */
+#define NETWORK_EMU_RED_MIN     5
+#define NETWORK_EMU_RED_MAX     15
+#define NETWORK_EMU_RED_MAXP    0.1
+#define NETWORK_EMU_RED_WEIGHT  0.002
+
+/* CoDel defaults (microseconds), as recommended by RFC 8289 */
+#define NETWORK_EMU_CODEL_TARGET    5000
+#define NETWORK_EMU_CODEL_INTERVAL  100000
+
+/* a copy of a packet that's been held back or delayed */
+typedef struct emu_packet
+{
+    struct emu_packet *next;
+    network_context_t *ctx;
+    uint64_t           release_us;  /* when it leaves the delay line */
+    unsigned int       countdown;   /* packets to send before this one */
+    size_t             len;
+    char               data[MAX_IP_PAYLOAD_LEN];
+} emu_packet_t;
+
+/* a packet fate trace, loaded from a file by _network_emu_parse().  this
+ * is shared (read-only) by every connection replaying it.
+ */
+typedef struct network_emu_trace
+{
+    int                 refcnt;
+    size_t              num_fates;
+    network_emu_fate_t *fates;
+} emu_trace_t;
+
+/* an emulated link:  a rate-limited queue, private to one connection or
+ * shared by all of them (with bottleneck=shared).  rather than actually
+ * holding packets until the token bucket lets them go, each packet's
+ * departure time is worked out as it arrives, and it goes straight into
+ * the delay line to be released once it has departed and crossed the link.
+ * as the queue is FIFO, the AQM's dequeue-time decisions can be made then
+ * too.
+ */
+typedef struct emu_link
+{
+    int                  refcnt;
+    network_emu_config_t cfg;
+
+    double               tokens;        /* bytes, as of tokens_us */
+    uint64_t             tokens_us;
+    uint64_t             link_free_us;  /* last departure so far */
+    uint64_t            *departures;    /* ring of queued departure times */
+    unsigned int         dep_head, dep_count;
+
+    /* RED state */
+    double               red_avg;       /* average queue length */
+    int                  red_count;     /* packets since the last drop */
+
+    /* CoDel state */
+    bool_t               codel_dropping;
+    uint64_t             codel_first_above_us;
+    uint64_t             codel_drop_next_us;
+    unsigned int         codel_count, codel_lastcount;
+} emu_link_t;
+
+/* per-connection emulation state, pointed to by network_context_t */
+typedef struct network_emu_state
+{
+    network_emu_config_t cfg;
+    uint64_t             rng;
+    bool_t               ge_bad;    /* Gilbert-Elliott state */
+
+    emu_packet_t        *held;      /* held back for reordering, in order */
+    unsigned int         num_held;
+
+    size_t               trace_pos; /* next fate to replay */
+
+    unsigned int         queued;    /* in the delay line (or being sent) */
+    emu_link_t          *link;      /* NULL unless rate limited */
+
+    /* statistics for _network_emu_get_stats() */
+    uint64_t             pkts_sent, pkts_lost, pkts_dropped;
+    uint64_t             pkts_delivered, bytes_delivered;
+    uint64_t             qdelay_total_us;
+    uint32_t             qdelay_max_us;
+    uint64_t             first_us, last_us;
+} network_emu_state_t;
+
+
+static pthread_once_t  emu_once = PTHREAD_ONCE_INIT;
+
+/* emu_lock protects the configuration, the delay line, the links, and the
+ * queued count and statistics in each connection's state.
+ */
+static pthread_mutex_t emu_lock;
+static pthread_cond_t  emu_cond;    /* delay line changed */
+static network_emu_config_t emu_config;
+static bool_t          emu_configured;  /* by STCP_NETEM or the API */
+
+static emu_link_t     *shared_link; /* for bottleneck=shared */
+
+static emu_packet_t   *delay_line;  /* sorted by release time */
+static pthread_t       delay_thread;
+static bool_t          delay_thread_started;
+
+
+static void _emu_init(void);
+static network_emu_state_t *_emu_get_state(network_context_t *ctx);
+static bool_t _emu_lose(network_emu_state_t *st);
+static uint64_t _emu_delay(network_emu_state_t *st);
+static void _emu_output(network_context_t *ctx, network_emu_state_t *st,
+                        const struct iovec *iov, int iovcnt,
+                        uint64_t delay_us);
+static void _emu_replay(network_context_t *ctx, network_emu_state_t *st,
+                        const struct iovec *iov, int iovcnt);
+static emu_trace_t *_emu_trace_load(const char *filename);
+static int _emu_trace_load_binary(FILE *fp, emu_trace_t *trace);
+static int _emu_trace_load_csv(FILE *fp, emu_trace_t *trace);
+static void _emu_trace_release(emu_trace_t *trace);
+static emu_link_t *_emu_link_create(const network_emu_config_t *cfg);
+static void _emu_link_release(emu_link_t *link);
+static bool_t _emu_link_enqueue(emu_link_t *link, network_emu_state_t *st,
+                                size_t len, uint64_t now,
+                                uint64_t *depart_us);
+static bool_t _emu_red_drop(emu_link_t *link, network_emu_state_t *st);
+static bool_t _emu_codel_drop(emu_link_t *link, uint64_t arrival_us,
+                              uint64_t depart_us);
+static uint64_t _emu_codel_control_law(emu_link_t *link, uint64_t t);
+static emu_packet_t *_emu_copy(network_context_t *ctx,
+                               const struct iovec *iov, int iovcnt);
+static void *delay_thread_func(void *arg);
+static double _emu_random(network_emu_state_t *st);
+static uint64_t _emu_now(void);
+static int _emu_parse_probability(const char *s, double *p);
+static int _emu_parse_time(const char *s, unsigned int *usec);
+static int _emu_parse_scaled(const char *s, const char *const *suffixes,
+                             const uint64_t *scales, uint64_t *value);
+
+
+ssize_t _network_emu_send(network_context_t *ctx,
+                          const struct iovec *iov, int iovcnt)
+{
+    network_emu_state_t *st;
+    emu_packet_t *pkt, **prev;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+
+    if (!(st = _emu_get_state(ctx)))
+        return _network_send_packet(ctx, iov, iovcnt);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+
+    if (st->cfg.trace)
+    {
+        _emu_replay(ctx, st, iov, iovcnt);
+        return len;
+    }
+
+    if (_emu_lose(st))
+    {
+        dprintf("====>network_send:dropping the packet\n");
+        PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+        ++st->pkts_sent;
+        ++st->pkts_lost;
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return len;
+    }
+
+    if (st->num_held < NETWORK_EMU_MAX_HELD &&
+        st->cfg.reorder > 0 && _emu_random(st) < st->cfg.reorder)
+    {
+        dprintf("====>network_send:holding the packet back\n");
+        pkt = _emu_copy(ctx, iov, iovcnt);
+        pkt->countdown = st->cfg.reorder_depth;
+
+        for (prev = &st->held; *prev; prev = &(*prev)->next)
+            ;
+        *prev = pkt;
+        ++st->num_held;
+        return len;
+    }
+
+    _emu_output(ctx, st, iov, iovcnt, _emu_delay(st));
+    if (st->cfg.dup > 0 && _emu_random(st) < st->cfg.dup)
+    {
+        dprintf("====>network_send:duplicating the packet\n");
+        _emu_output(ctx, st, iov, iovcnt, _emu_delay(st));
+    }
+
+    /* release any held packets whose turn has come */
+    for (prev = &st->held; (pkt = *prev) != NULL; )
+    {
+        struct iovec held_iov;
+
+        if (--pkt->countdown > 0)
+        {
+            prev = &pkt->next;
+            continue;
+        }
+
+        dprintf("====>network_send:sending a held packet\n");
+        held_iov.iov_base = pkt->data;
+        held_iov.iov_len  = pkt->len;
+        _emu_output(ctx, st, &held_iov, 1, _emu_delay(st));
+
+        *prev = pkt->next;
+        --st->num_held;
+        free(pkt);
+    }
+
+    return len;
+}
+
+bool_t _network_emu_bypass(network_context_t *ctx)
+{
+    assert(ctx);
+    return _emu_get_state(ctx) == NULL;
+}
+
+void _network_emu_close(network_context_t *ctx)
+{
+    network_emu_state_t *st;
+
+    assert(ctx);
+    if (!(st = ctx->emu))
+        return;
+
+    /* don't lose the last few packets of the connection (e.g. the final
+     * ACK) just because they were still in the delay line.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    while (st->queued > 0)
+        PTHREAD_CALL(pthread_cond_wait(&emu_cond, &emu_lock));
+    if (st->link)
+        _emu_link_release(st->link);
+    if (st->cfg.trace)
+        _emu_trace_release(st->cfg.trace);
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+
+    while (st->held)
+    {
+        emu_packet_t *pkt = st->held;
+        st->held = pkt->next;
+        free(pkt);
+    }
+
+    free(st);
+    ctx->emu = NULL;
+}
+
+void _network_emu_get_stats(network_context_t *ctx,
+                            struct stcp_netem_stats *stats)
+{
+    network_emu_state_t *st;
+
+    assert(ctx && stats);
+    memset(stats, 0, sizeof(*stats));
+
+    PTHREAD_CALL(pthread_once(&emu_once, _emu_init));
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    if ((st = ctx->emu) != NULL)
+    {
+        stats->ns_pkts_sent       = st->pkts_sent;
+        stats->ns_pkts_lost       = st->pkts_lost;
+        stats->ns_pkts_dropped    = st->pkts_dropped;
+        stats->ns_pkts_delivered  = st->pkts_delivered;
+        stats->ns_bytes_delivered = st->bytes_delivered;
+
+        if (st->pkts_delivered > 0)
+            stats->ns_qdelay_avg = st->qdelay_total_us / st->pkts_delivered;
+        stats->ns_qdelay_max = st->qdelay_max_us;
+
+        if (st->last_us > st->first_us)
+            stats->ns_goodput = st->bytes_delivered * 8 * 1000000 /
+                                (st->last_us - st->first_us);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+}
+
+int _network_emu_set_config(const char *spec)
+{
+    network_emu_config_t cfg;
+
+    PTHREAD_CALL(pthread_once(&emu_once, _emu_init));
+
+    if (spec && _network_emu_parse(spec, &cfg) < 0)
+        return -1;
+
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    if (emu_config.trace)
+        _emu_trace_release(emu_config.trace);
+    memset(&emu_config, 0, sizeof(emu_config));
+    if (spec)
+        emu_config = cfg;
+    emu_configured = (spec != NULL);
+
+    /* connections started from now on share a new bottleneck */
+    if (shared_link)
+    {
+        _emu_link_release(shared_link);
+        shared_link = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+
+    return 0;
+}
+
+int _network_emu_parse(const char *spec, network_emu_config_t *cfg)
+{
+    char *buf, *token, *save = NULL;
+    int rc = 0;
+
+    assert(spec && cfg);
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->reorder_depth = 1;
+    cfg->ge_loss_bad   = 1.0;
+    cfg->burst         = MAX_IP_PAYLOAD_LEN;
+    cfg->limit         = NETWORK_EMU_DEFAULT_LIMIT;
+    cfg->aqm           = NETWORK_EMU_DROPTAIL;
+    cfg->red_min       = NETWORK_EMU_RED_MIN;
+    cfg->red_max       = NETWORK_EMU_RED_MAX;
+    cfg->red_maxp      = NETWORK_EMU_RED_MAXP;
+    cfg->codel_target_us   = NETWORK_EMU_CODEL_TARGET;
+    cfg->codel_interval_us = NETWORK_EMU_CODEL_INTERVAL;
+
+    if (!(buf = strdup(spec)))
+        return -1;
+
+    for (token = strtok_r(buf, ", \t", &save); token && rc == 0;
+         token = strtok_r(NULL, ", \t", &save))
+    {
+        char *value = strchr(token, '=');
+
+        if (!strcmp(token, "none"))
+            continue;
+
+        if (!value)
+        {
+            rc = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(token, "seed"))
+        {
+            char *end;
+
+            cfg->seed = (uint32_t) strtoul(value, &end, 0);
+            if (end == value || *end)
+                rc = -1;
+        }
+        else if (!strcmp(token, "loss"))
+            rc = _emu_parse_probability(value, &cfg->loss);
+        else if (!strcmp(token, "dup"))
+            rc = _emu_parse_probability(value, &cfg->dup);
+        else if (!strcmp(token, "delay"))
+            rc = _emu_parse_time(value, &cfg->delay_us);
+        else if (!strcmp(token, "jitter"))
+            rc = _emu_parse_time(value, &cfg->jitter_us);
+        else if (!strcmp(token, "rate"))
+        {
+            static const char *const suffixes[] =
+                { "", "bit", "kbit", "mbit", "gbit", NULL };
+            static const uint64_t scales[] =
+                { 1, 1, 1000, 1000000, 1000000000 };
+
+            rc = _emu_parse_scaled(value, suffixes, scales, &cfg->rate_bps);
+        }
+        else if (!strcmp(token, "burst") || !strcmp(token, "limit"))
+        {
+            static const char *const suffixes[] = { "", "k", "m", NULL };
+            static const uint64_t scales[] = { 1, 1024, 1024 * 1024 };
+            uint64_t n;
+
+            if ((rc = _emu_parse_scaled(value, suffixes, scales, &n)) == 0)
+            {
+                if (n == 0 || n > 0x7fffffff)
+                    rc = -1;
+                else if (!strcmp(token, "burst"))
+                    cfg->burst = MAX(n, MAX_IP_PAYLOAD_LEN);
+                else
+                    cfg->limit = n;
+            }
+        }
+        else if (!strcmp(token, "bottleneck"))
+        {
+            if (!strcmp(value, "shared"))
+                cfg->shared = TRUE;
+            else if (!strcmp(value, "private"))
+                cfg->shared = FALSE;
+            else
+                rc = -1;
+        }
+        else if (!strcmp(token, "aqm"))
+        {
+            if (!strcmp(value, "droptail"))
+                cfg->aqm = NETWORK_EMU_DROPTAIL;
+            else if (!strcmp(value, "red"))
+                cfg->aqm = NETWORK_EMU_RED;
+            else if (!strcmp(value, "codel"))
+                cfg->aqm = NETWORK_EMU_CODEL;
+            else
+                rc = -1;
+        }
+        else if (!strcmp(token, "red"))
+        {
+            char *max_th = strchr(value, ':'), *maxp = NULL, *end;
+
+            if (!max_th || !(maxp = strchr(++max_th, ':')))
+                rc = -1;
+            else
+            {
+                *maxp++ = '\0';
+                cfg->red_min = (unsigned int) strtoul(value, &end, 10);
+                if (*end != ':')
+                    rc = -1;
+                cfg->red_max = (unsigned int) strtoul(max_th, &end, 10);
+                if (*end || cfg->red_max <= cfg->red_min)
+                    rc = -1;
+                if (rc == 0)
+                    rc = _emu_parse_probability(maxp, &cfg->red_maxp);
+            }
+        }
+        else if (!strcmp(token, "codel"))
+        {
+            char *interval = strchr(value, ':');
+
+            if (interval)
+            {
+                *interval++ = '\0';
+                rc = _emu_parse_time(interval, &cfg->codel_interval_us);
+                if (cfg->codel_interval_us == 0)
+                    rc = -1;
+            }
+            if (rc == 0)
+                rc = _emu_parse_time(value, &cfg->codel_target_us);
+        }
+        else if (!strcmp(token, "trace"))
+        {
+            if (cfg->trace)
+                _emu_trace_release(cfg->trace);
+            if (!(cfg->trace = _emu_trace_load(value)))
+            {
+                int err = errno;
+                free(buf);
+                errno = err;
+                return -1;
+            }
+        }
+        else if (!strcmp(token, "reorder"))
+        {
+            char *depth = strchr(value, ':');
+
+            if (depth)
+            {
+                char *end;
+
+                *depth++ = '\0';
+                cfg->reorder_depth = (unsigned int) strtoul(depth, &end, 10);
+                if (end == depth || *end || cfg->reorder_depth == 0)
+                    rc = -1;
+            }
+            if (rc == 0)
+                rc = _emu_parse_probability(value, &cfg->reorder);
+        }
+        else if (!strcmp(token, "ge"))
+        {
+            double *params[] = { &cfg->ge_p, &cfg->ge_r,
+                                 &cfg->ge_loss_bad, &cfg->ge_loss_good };
+            unsigned int k;
+            char *next = value;
+
+            for (k = 0; k < ARRAY_DIM(params) && next && rc == 0; ++k)
+            {
+                char *field = next;
+
+                if ((next = strchr(field, ':')) != NULL)
+                    *next++ = '\0';
+                rc = _emu_parse_probability(field, params[k]);
+            }
+
+            /* both transition probabilities are required */
+            if (k < 2 || next)
+                rc = -1;
+        }
+        else
+            rc = -1;
+    }
+
+    free(buf);
+
+    if (rc < 0)
+    {
+        if (cfg->trace)
+            _emu_trace_release(cfg->trace);
+        cfg->trace = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+
+    cfg->enabled = (cfg->loss > 0 || cfg->ge_p > 0 || cfg->dup > 0 ||
+                    cfg->reorder > 0 || cfg->delay_us > 0 ||
+                    cfg->jitter_us > 0 || cfg->rate_bps > 0 ||
+                    cfg->trace != NULL);
+    return 0;
+}
+
+
+static void _emu_init(void)
+{
+    const char *spec;
+
+    PTHREAD_CALL(pthread_mutex_init(&emu_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&emu_cond, NULL));
+
+    if ((spec = getenv("STCP_NETEM")) != NULL)
+    {
+        if (_network_emu_parse(spec, &emu_config) < 0)
+        {
+            fprintf(stderr, "STCP_NETEM: invalid setting \"%s\": %s\n",
+                    spec, strerror(errno));
+        }
+        else
+            emu_configured = TRUE;
+    }
+}
+
+/* return the connection's emulation state, setting it up the first time
+ * the connection sends anything, or NULL if the connection is unimpaired.
+ * this is only called from the transport thread.
+ */
+static network_emu_state_t *_emu_get_state(network_context_t *ctx)
+{
+    network_emu_config_t cfg;
+    network_emu_state_t *st;
+
+    assert(ctx);
+    if (ctx->emu_started)
+        return ctx->emu;
+
+    PTHREAD_CALL(pthread_once(&emu_once, _emu_init));
+
+    /* the trace and shared link are referenced under the same lock as the
+     * configuration is copied, so mysetnetem() can't release them first
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    cfg = emu_config;
+    if (!emu_configured && !ctx->is_reliable)
+        (void) _network_emu_parse(NETWORK_EMU_UNRELIABLE, &cfg);
+    else if (!emu_configured)
+        cfg.enabled = FALSE;
+
+    ctx->emu_started = TRUE;
+    if (!cfg.enabled)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return NULL;
+    }
+
+    st = (network_emu_state_t *) calloc(1, sizeof(network_emu_state_t));
+    assert(st);
+    st->cfg = cfg;
+    st->rng = ((uint64_t) cfg.seed << 1) | 1;  /* xorshift state != 0 */
+
+    if (cfg.trace)
+        ++cfg.trace->refcnt;
+
+    if (cfg.rate_bps > 0)
+    {
+        if (!cfg.shared)
+            st->link = _emu_link_create(&cfg);
+        else
+        {
+            if (!shared_link)
+                shared_link = _emu_link_create(&cfg);
+            st->link = shared_link;
+            ++st->link->refcnt;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+
+    return (ctx->emu = st);
+}
+
+/* decide whether the next packet is lost */
+static bool_t _emu_lose(network_emu_state_t *st)
+{
+    assert(st);
+
+    if (st->cfg.ge_p > 0)
+    {
+        if (_emu_random(st) < (st->ge_bad ? st->cfg.ge_r : st->cfg.ge_p))
+            st->ge_bad = !st->ge_bad;
+
+        return _emu_random(st) < (st->ge_bad ? st->cfg.ge_loss_bad :
+                                               st->cfg.ge_loss_good);
+    }
+
+    return st->cfg.loss > 0 && _emu_random(st) < st->cfg.loss;
+}
+
+/* the delay for the next packet:  the configured delay plus jitter */
+static uint64_t _emu_delay(network_emu_state_t *st)
+{
+    int64_t delay;
+
+    assert(st);
+
+    delay = st->cfg.delay_us;
+    if (st->cfg.jitter_us > 0)
+        delay += (int64_t) ((2 * _emu_random(st) - 1) * st->cfg.jitter_us);
+
+    return (delay > 0) ? delay : 0;
+}
+
+/* send a packet that has survived the impairments, once it has crossed
+ * the emulated link (if any), delay_us later.
+ */
+static void _emu_output(network_context_t *ctx, network_emu_state_t *st,
+                        const struct iovec *iov, int iovcnt,
+                        uint64_t delay_us)
+{
+    emu_packet_t *pkt, **prev;
+    uint64_t arrival, depart;
+    size_t len = 0, payload_len;
+    int k;
+
+    assert(ctx && st && iov && iovcnt > 0);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+    payload_len = len - TCP_DATA_START(iov[0].iov_base);
+
+    arrival = depart = _emu_now();
+
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    ++st->pkts_sent;
+    if (st->link && !_emu_link_enqueue(st->link, st, len, arrival, &depart))
+    {
+        dprintf("====>network_send:link queue dropped the packet\n");
+        ++st->pkts_dropped;
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return;
+    }
+
+    if (st->pkts_delivered++ == 0)
+        st->first_us = arrival;
+    st->last_us = depart;
+    st->bytes_delivered += payload_len;
+    st->qdelay_total_us += depart - arrival;
+    st->qdelay_max_us = MAX(st->qdelay_max_us, (uint32_t) (depart - arrival));
+
+    /* packets are only sent directly if none are ever delayed, so only
+     * one thread writes to the connection's socket.
+     */
+    if (!st->link && !st->cfg.trace &&
+        st->cfg.delay_us == 0 && st->cfg.jitter_us == 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        (void) _network_send_packet(ctx, iov, iovcnt);
+        return;
+    }
+
+    pkt = _emu_copy(ctx, iov, iovcnt);
+    pkt->release_us = depart + delay_us;
+
+    if (!delay_thread_started)
+    {
+        PTHREAD_CALL(pthread_create(&delay_thread, NULL,
+                                    delay_thread_func, NULL));
+        PTHREAD_CALL(pthread_detach(delay_thread));
+        delay_thread_started = TRUE;
+    }
+
+    /* packets due at the same time leave in the order they were sent */
+    for (prev = &delay_line;
+         *prev && (*prev)->release_us <= pkt->release_us;
+         prev = &(*prev)->next)
+        ;
+    pkt->next = *prev;
+    *prev = pkt;
+    ++st->queued;
+
+    if (delay_line == pkt)
+        PTHREAD_CALL(pthread_cond_broadcast(&emu_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+}
+
+/* give a packet the next fate from the connection's trace, wrapping round
+ * to the start once the trace is exhausted.
+ */
+static void _emu_replay(network_context_t *ctx, network_emu_state_t *st,
+                        const struct iovec *iov, int iovcnt)
+{
+    const network_emu_fate_t *fate;
+
+    assert(ctx && st && st->cfg.trace && st->cfg.trace->num_fates > 0);
+
+    fate = &st->cfg.trace->fates[st->trace_pos];
+    if (++st->trace_pos == st->cfg.trace->num_fates)
+        st->trace_pos = 0;
+
+    if (fate->flags & NETWORK_EMU_FATE_DROP)
+    {
+        dprintf("====>network_send:dropping the packet (trace)\n");
+        PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+        ++st->pkts_sent;
+        ++st->pkts_lost;
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return;
+    }
+
+    _emu_output(ctx, st, iov, iovcnt, fate->delay_us);
+    if (fate->flags & NETWORK_EMU_FATE_DUP)
+    {
+        dprintf("====>network_send:duplicating the packet (trace)\n");
+        _emu_output(ctx, st, iov, iovcnt, fate->delay_us);
+    }
+}
+
+/* create a link with the rate, queue and AQM given by cfg.  assumes
+ * emu_lock is held.
+ */
+static emu_link_t *_emu_link_create(const network_emu_config_t *cfg)
+{
+    emu_link_t *link;
+
+    assert(cfg && cfg->rate_bps > 0 && cfg->limit > 0);
+
+    link = (emu_link_t *) calloc(1, sizeof(emu_link_t));
+    assert(link);
+
+    link->refcnt = 1;
+    link->cfg = *cfg;
+    link->tokens = cfg->burst;
+    link->tokens_us = _emu_now();
+    link->departures = (uint64_t *) malloc(cfg->limit * sizeof(uint64_t));
+    assert(link->departures);
+
+    return link;
+}
+
+/* drop a reference to link.  assumes emu_lock is held. */
+static void _emu_link_release(emu_link_t *link)
+{
+    assert(link && link->refcnt > 0);
+    if (--link->refcnt > 0)
+        return;
+
+    free(link->departures);
+    free(link);
+}
+
+/* work out when a packet of len bytes arriving at the link at time now
+ * leaves it, i.e. once the packets ahead of it have gone and the token
+ * bucket holds len bytes.  returns FALSE if the packet is dropped instead,
+ * because the queue is full or by the AQM.  st is the sending connection.
+ * assumes emu_lock is held.
+ */
+static bool_t _emu_link_enqueue(emu_link_t *link, network_emu_state_t *st,
+                                size_t len, uint64_t now,
+                                uint64_t *depart_us)
+{
+    double   rate = link->cfg.rate_bps / 8e6;   /* bytes per microsecond */
+    uint64_t start, depart;
+    double   tokens;
+
+    assert(link && link->departures && st && depart_us);
+
+    /* forget the packets that have left the queue by now */
+    while (link->dep_count > 0 && link->departures[link->dep_head] <= now)
+    {
+        link->dep_head = (link->dep_head + 1) % link->cfg.limit;
+        --link->dep_count;
+    }
+
+    if (link->dep_count == link->cfg.limit)
+        return FALSE;
+
+    if (link->cfg.aqm == NETWORK_EMU_RED && _emu_red_drop(link, st))
+        return FALSE;
+
+    /* bring the bucket up to date as of when the link is next free */
+    start = MAX(now, link->link_free_us);
+    tokens = link->tokens + (start - link->tokens_us) * rate;
+    if (tokens > link->cfg.burst)
+        tokens = link->cfg.burst;
+
+    depart = start;
+    if (tokens < len)
+        depart += (uint64_t) ((len - tokens) / rate + 0.5);
+
+    /* CoDel drops at the head of the queue, so a packet it drops never
+     * uses the link.
+     */
+    if (link->cfg.aqm == NETWORK_EMU_CODEL &&
+        _emu_codel_drop(link, now, depart))
+        return FALSE;
+
+    /* the bucket is now empty if we had to wait for it */
+    link->tokens = (depart > start) ? 0 : tokens - len;
+    link->tokens_us = depart;
+    link->link_free_us = depart;
+
+    link->departures[(link->dep_head + link->dep_count) % link->cfg.limit] =
+        depart;
+    ++link->dep_count;
+
+    *depart_us = depart;
+    return TRUE;
+}
+
+/* RED:  drop an arriving packet with a probability that grows with the
+ * average queue length between the two thresholds (Floyd and Jacobson,
+ * 1993).  assumes emu_lock is held.
+ */
+static bool_t _emu_red_drop(emu_link_t *link, network_emu_state_t *st)
+{
+    double pb, pa;
+
+    assert(link && st);
+
+    link->red_avg += NETWORK_EMU_RED_WEIGHT *
+                     ((double) link->dep_count - link->red_avg);
+
+    if (link->red_avg < link->cfg.red_min)
+    {
+        link->red_count = -1;
+        return FALSE;
+    }
+
+    if (link->red_avg >= link->cfg.red_max)
+    {
+        link->red_count = 0;
+        return TRUE;
+    }
+
+    ++link->red_count;
+    pb = link->cfg.red_maxp * (link->red_avg - link->cfg.red_min) /
+         (link->cfg.red_max - link->cfg.red_min);
+    pa = (link->red_count * pb < 1) ? pb / (1 - link->red_count * pb) : 1;
+
+    if (_emu_random(st) < pa)
+    {
+        link->red_count = 0;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* CoDel (RFC 8289):  decide, at the time a packet reaches the head of the
+ * queue (depart_us), whether to drop it, based on how long it has spent in
+ * the queue.  packets are considered in FIFO order, as a real dequeue
+ * would see them.  assumes emu_lock is held.
+ */
+static bool_t _emu_codel_drop(emu_link_t *link, uint64_t arrival_us,
+                              uint64_t depart_us)
+{
+    uint64_t now = depart_us;
+    bool_t   ok_to_drop = FALSE;
+
+    assert(link);
+
+    /* is the sojourn time persistently above target? */
+    if (depart_us - arrival_us < link->cfg.codel_target_us ||
+        link->dep_count == 0)
+    {
+        link->codel_first_above_us = 0;
+    }
+    else if (link->codel_first_above_us == 0)
+    {
+        link->codel_first_above_us = now + link->cfg.codel_interval_us;
+    }
+    else if (now >= link->codel_first_above_us)
+    {
+        ok_to_drop = TRUE;
+    }
+
+    if (link->codel_dropping)
+    {
+        if (!ok_to_drop)
+        {
+            link->codel_dropping = FALSE;
+            return FALSE;
+        }
+
+        if (now < link->codel_drop_next_us)
+            return FALSE;
+
+        ++link->codel_count;
+        link->codel_drop_next_us =
+            _emu_codel_control_law(link, link->codel_drop_next_us);
+        return TRUE;
+    }
+
+    if (!ok_to_drop)
+        return FALSE;
+
+    /* enter the dropping state, resuming near the previous drop rate if
+     * we were dropping recently
+     */
+    link->codel_dropping = TRUE;
+    if (link->codel_count - link->codel_lastcount > 1 &&
+        now - link->codel_drop_next_us < 16 * link->cfg.codel_interval_us)
+        link->codel_count = link->codel_count - link->codel_lastcount;
+    else
+        link->codel_count = 1;
+    link->codel_lastcount = link->codel_count;
+    link->codel_drop_next_us = _emu_codel_control_law(link, now);
+    return TRUE;
+}
+
+/* t + interval / sqrt(count) */
+static uint64_t _emu_codel_control_law(emu_link_t *link, uint64_t t)
+{
+    double count = link->codel_count, root = count;
+    int k;
+
+    assert(count >= 1);
+
+    /* a few rounds of Newton's method, to avoid needing libm */
+    for (k = 0; k < 20; ++k)
+        root = (root + count / root) / 2;
+
+    return t + (uint64_t) (link->cfg.codel_interval_us / root);
+}
+
+static emu_packet_t *_emu_copy(network_context_t *ctx,
+                               const struct iovec *iov, int iovcnt)
+{
+    emu_packet_t *pkt;
+    int k;
+
+    pkt = (emu_packet_t *) malloc(sizeof(emu_packet_t));
+    assert(pkt);
+
+    pkt->next      = NULL;
+    pkt->ctx       = ctx;
+    pkt->countdown = 0;
+    pkt->len       = 0;
+    for (k = 0; k < iovcnt; ++k)
+    {
+        assert(pkt->len + iov[k].iov_len <= sizeof(pkt->data));
+        memcpy(pkt->data + pkt->len, iov[k].iov_base, iov[k].iov_len);
+        pkt->len += iov[k].iov_len;
+    }
+
+    return pkt;
+}
+
+/* the delay line thread.  this sends each delayed packet once its release
+ * time has come.
+ */
+static void *delay_thread_func(void *arg)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    for (;;)
+    {
+        emu_packet_t *pkt;
+        struct iovec iov;
+        uint64_t now;
+
+        if (!(pkt = delay_line))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&emu_cond, &emu_lock));
+            continue;
+        }
+
+        if ((now = _emu_now()) < pkt->release_us)
+        {
+            struct timespec deadline;
+            int rc;
+
+            deadline.tv_sec  = pkt->release_us / 1000000;
+            deadline.tv_nsec = (pkt->release_us % 1000000) * 1000;
+            rc = pthread_cond_timedwait(&emu_cond, &emu_lock, &deadline);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+            continue;
+        }
+
+        delay_line = pkt->next;
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+
+        iov.iov_base = pkt->data;
+        iov.iov_len  = pkt->len;
+        (void) _network_send_packet(pkt->ctx, &iov, 1);
+
+        PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+        assert(pkt->ctx->emu && pkt->ctx->emu->queued > 0);
+        if (--pkt->ctx->emu->queued == 0)
+            PTHREAD_CALL(pthread_cond_broadcast(&emu_cond));
+        free(pkt);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* uniform random number in [0, 1), from the connection's own xorshift64*
+ * generator, so a given seed gives the same sequence on every platform.
+ */
+static double _emu_random(network_emu_state_t *st)
+{
+    uint64_t x = st->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    st->rng = x;
+
+    return (double) ((x * 0x2545F4914F6CDD1DULL) >> 11) /
+           (double) (1ULL << 53);
+}
+
+/* current time in microseconds, on the clock used by pthread_cond_timedwait */
+static uint64_t _emu_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static int _emu_parse_probability(const char *s, double *p)
+{
+    char *end;
+    double value;
+
+    assert(s && p);
+
+    value = strtod(s, &end);
+    if (end == s)
+        return -1;
+
+    if (*end == '%')
+    {
+        value /= 100;
+        ++end;
+    }
+
+    if (*end || value < 0 || value > 1)
+        return -1;
+
+    *p = value;
+    return 0;
+}
+
+static int _emu_parse_time(const char *s, unsigned int *usec)
+{
+    char *end;
+    double value;
+
+    assert(s && usec);
+
+    value = strtod(s, &end);
+    if (end == s || value < 0)
+        return -1;
+
+    if (!strcmp(end, "s"))
+        value *= 1000000;
+    else if (!strcmp(end, "ms"))
+        value *= 1000;
+    else if (*end && strcmp(end, "us"))
+        return -1;
+
+    if (value > 60 * 1000000.0)     /* be reasonable */
+        return -1;
+
+    *usec = (unsigned int) value;
+    return 0;
+}
+
+/* parse a number with one of the given suffixes, multiplying it by the
+ * corresponding scale.  suffixes is NULL-terminated.
+ */
+static int _emu_parse_scaled(const char *s, const char *const *suffixes,
+                             const uint64_t *scales, uint64_t *value)
+{
+    char *end;
+    double n;
+    int k;
+
+    assert(s && suffixes && scales && value);
+
+    n = strtod(s, &end);
+    if (end == s || n < 0)
+        return -1;
+
+    for (k = 0; suffixes[k]; ++k)
+    {
+        if (!strcasecmp(end, suffixes[k]))
+        {
+            *value = (uint64_t) (n * scales[k]);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* load a fate trace, in either the binary or the CSV format described in
+ * network_emu.h.  returns NULL (with errno set) on error.
+ */
+static emu_trace_t *_emu_trace_load(const char *filename)
+{
+    network_emu_trace_header_t header;
+    emu_trace_t *trace;
+    FILE *fp;
+    int rc;
+
+    assert(filename);
+
+    if (!(fp = fopen(filename, "rb")))
+        return NULL;
+
+    trace = (emu_trace_t *) calloc(1, sizeof(emu_trace_t));
+    assert(trace);
+    trace->refcnt = 1;
+
+    if (fread(&header, sizeof(header), 1, fp) == 1 &&
+        !memcmp(header.magic, NETWORK_EMU_TRACE_MAGIC, sizeof(header.magic)))
+    {
+        rc = (header.record_len == sizeof(network_emu_fate_t)) ?
+             _emu_trace_load_binary(fp, trace) : -1;
+    }
+    else
+    {
+        rewind(fp);
+        rc = _emu_trace_load_csv(fp, trace);
+    }
+    fclose(fp);
+
+    if (rc < 0 || trace->num_fates == 0)
+    {
+        free(trace->fates);
+        free(trace);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return trace;
+}
+
+static int _emu_trace_load_binary(FILE *fp, emu_trace_t *trace)
+{
+    size_t alloc = 0;
+
+    assert(fp && trace);
+
+    for (;;)
+    {
+        size_t n;
+
+        if (trace->num_fates == alloc)
+        {
+            alloc = alloc ? 2 * alloc : 1024;
+            trace->fates = (network_emu_fate_t *)
+                realloc(trace->fates, alloc * sizeof(network_emu_fate_t));
+            assert(trace->fates);
+        }
+
+        n = fread(trace->fates + trace->num_fates, sizeof(network_emu_fate_t),
+                  alloc - trace->num_fates, fp);
+        trace->num_fates += n;
+
+        if (trace->num_fates < alloc)
+            return ferror(fp) ? -1 : 0;
+    }
+}
+
+/* each line is "drop,delay_us,dup"; blank lines, comments (from '#') and a
+ * header line are ignored.
+ */
+static int _emu_trace_load_csv(FILE *fp, emu_trace_t *trace)
+{
+    char line[256];
+    size_t alloc = 0;
+    int line_num = 0;
+
+    assert(fp && trace);
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        network_emu_fate_t fate;
+        unsigned long drop, delay, dup;
+        char *p, *end;
+
+        ++line_num;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+
+        for (p = line; *p == ' ' || *p == '\t'; ++p)
+            ;
+        if (*p == '\0' || *p == '\n' || *p == '\r')
+            continue;
+        if (line_num == 1 && !(*p >= '0' && *p <= '9'))
+            continue;   /* header */
+
+        drop = strtoul(p, &end, 10);
+        if (end == p || *end++ != ',')
+            return -1;
+        delay = strtoul(p = end, &end, 10);
+        if (end == p || *end++ != ',')
+            return -1;
+        dup = strtoul(p = end, &end, 10);
+        if (end == p || strspn(end, " \t\r\n") != strlen(end))
+            return -1;
+
+        memset(&fate, 0, sizeof(fate));
+        fate.delay_us = (uint32_t) delay;
+        fate.flags    = (drop ? NETWORK_EMU_FATE_DROP : 0) |
+                        (dup ? NETWORK_EMU_FATE_DUP : 0);
+
+        if (trace->num_fates == alloc)
+        {
+            alloc = alloc ? 2 * alloc : 1024;
+            trace->fates = (network_emu_fate_t *)
+                realloc(trace->fates, alloc * sizeof(network_emu_fate_t));
+            assert(trace->fates);
+        }
+        trace->fates[trace->num_fates++] = fate;
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
+
+/* drop a reference to trace.  assumes emu_lock is held (or that the trace
+ * hasn't been published yet).
+ */
+static void _emu_trace_release(emu_trace_t *trace)
+{
+    assert(trace && trace->refcnt > 0);
+    if (--trace->refcnt > 0)
+        return;
+
+    free(trace->fates);
+    free(trace);
+}
@@ -0,0 +1,153 @@
+/* network_emu.h--network impairment emulation.  this is an internal
+ * header, used only by the simulated network layer.
+ *
+ * packets sent by a mysocket can be dropped (uniformly, or in bursts
+ * following a Gilbert-Elliott model), duplicated, held back behind later
+ * packets, and delayed by a fixed amount plus uniform jitter.  each
+ * mysocket's outgoing packets can also be put through an emulated link:  a
+ * token bucket limits them to a given rate, with a finite drop-tail queue
+ * in front of it, and they then see the propagation delay (and jitter)
+ * above.  the impairments are described by a string of comma- or
+ * space-separated key=value settings:
+ *
+ *   seed=N           seed for the random number generator
+ *   loss=P           drop each packet with probability P
+ *   ge=P:R[:B[:G]]   Gilbert-Elliott loss: move from the good state to the
+ *                    bad one with probability P, and back with probability
+ *                    R, per packet; packets are lost with probability B
+ *                    (default 100%) in the bad state and G (default 0) in
+ *                    the good one.  overrides loss.
+ *   dup=P            send each packet twice with probability P
+ *   reorder=P[:D]    hold a packet back with probability P, until D
+ *                    (default 1) later packets have been sent
+ *   delay=T          delay every packet by T
+ *   jitter=T         vary the delay uniformly by up to +/- T
+ *   rate=R           limit the link to R bits per second
+ *   burst=S          token bucket depth, in bytes (default, and minimum,
+ *                    one maximum-sized packet)
+ *   limit=N          packets queued for the link before further ones are
+ *                    dropped (default 1000)
+ *   bottleneck=B     "private" (the default) gives each mysocket its own
+ *                    link; with "shared", all of the process's mysockets
+ *                    share a single link (and its queue)
+ *   aqm=A            queue discipline: "droptail" (the default), "red" or
+ *                    "codel"
+ *   red=MIN:MAX:P    RED thresholds (packets) and maximum drop probability
+ *                    (default 5:15:10%)
+ *   codel=T[:I]      CoDel target and interval (default 5ms:100ms)
+ *   trace=FILE       replay the per-packet fates recorded in FILE (see
+ *                    below) instead of the random loss, duplication,
+ *                    reordering, delay and jitter above
+ *
+ * probabilities are fractions, or percentages with a trailing '%'; times
+ * are in microseconds, or have a us, ms or s suffix; rates may have a
+ * kbit, mbit or gbit suffix, and sizes a k or m suffix.  an empty string
+ * or "none" disables emulation.
+ *
+ * a fate trace gives, for each packet a connection sends in turn, whether
+ * it's dropped, its delay, and whether it's duplicated; each connection
+ * starts at the beginning, and wraps round at the end.  a trace is either
+ * a CSV file with a "drop,delay_us,dup" line per packet (e.g. "0,20000,0";
+ * blank lines, '#' comments and a header line are ignored), or a binary
+ * file:  a network_emu_trace_header_t, then network_emu_fate_t records, in
+ * host byte order.
+ *
+ * the emulator keeps per-connection statistics (see mygetnetemstats()):
+ * packets lost or dropped by the link's queue, and the goodput and
+ * queueing delay of the packets that got through.
+ */
+
+#ifndef __NETWORK_EMU_H__
+#define __NETWORK_EMU_H__
+
+#include <sys/uio.h>
+#include "mysock.h"
+#include "network_io.h"
+
+/* queue disciplines */
+enum
+{
+    NETWORK_EMU_DROPTAIL,
+    NETWORK_EMU_RED,
+    NETWORK_EMU_CODEL
+};
+
+/* binary fate trace format */
+#define NETWORK_EMU_TRACE_MAGIC "STCPFAT1"
+
+typedef struct
+{
+    char     magic[8];      /* NETWORK_EMU_TRACE_MAGIC, not terminated */
+    uint32_t record_len;    /* sizeof(network_emu_fate_t) */
+    uint32_t reserved;
+} network_emu_trace_header_t;
+
+#define NETWORK_EMU_FATE_DROP   0x1
+#define NETWORK_EMU_FATE_DUP    0x2
+
+typedef struct
+{
+    uint32_t delay_us;
+    uint8_t  flags;         /* NETWORK_EMU_FATE_* */
+    uint8_t  reserved[3];
+} network_emu_fate_t;
+
+struct network_emu_trace;
+
+typedef struct
+{
+    bool_t       enabled;
+    uint32_t     seed;
+    double       loss;
+    double       ge_p, ge_r;        /* good->bad, bad->good transitions */
+    double       ge_loss_bad, ge_loss_good;
+    double       dup;
+    double       reorder;
+    unsigned int reorder_depth;
+    unsigned int delay_us;
+    unsigned int jitter_us;
+    uint64_t     rate_bps;          /* 0 for unlimited */
+    unsigned int burst;
+    unsigned int limit;
+    bool_t       shared;
+    int          aqm;
+    unsigned int red_min, red_max;
+    double       red_maxp;
+    unsigned int codel_target_us, codel_interval_us;
+    struct network_emu_trace *trace;    /* NULL unless replaying a trace */
+} network_emu_config_t;
+
+/* parse a description of the impairments (see above) into cfg, loading
+ * any trace it names.  returns 0 on success, or -1 (with errno set) if
+ * spec is malformed or the trace can't be read.
+ */
+int _network_emu_parse(const char *spec, network_emu_config_t *cfg);
+
+/* set the impairments applied by connections that start after this call,
+ * replacing those from the STCP_NETEM environment variable.  spec may be
+ * NULL to restore the defaults.  returns 0 or -1 as for the above.
+ */
+int _network_emu_set_config(const char *spec);
+
+/* pass a packet, gathered from iovcnt buffers, through the connection's
+ * impairments on the way to _network_send_packet().  returns the packet
+ * length (whatever its fate), or -1 on error.
+ */
+ssize_t _network_emu_send(network_context_t *ctx,
+                          const struct iovec *iov, int iovcnt);
+
+/* TRUE if packets sent on ctx go straight to the network I/O layer */
+bool_t _network_emu_bypass(network_context_t *ctx);
+
+/* release the connection's emulation state, once any packets it has in
+ * the delay line have been sent.
+ */
+void _network_emu_close(network_context_t *ctx);
+
+/* fetch the connection's emulation statistics (all zero if it's
+ * unimpaired)
+ */
+void _network_emu_get_stats(network_context_t *ctx,
+                            struct stcp_netem_stats *stats);
+
+#endif  /* __NETWORK_EMU_H__ */
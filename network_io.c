@@ -15,6 +15,12 @@
  * onerous a restriction, as this interface is used only in the TCP
  * checksum calculation, which satisfies the aforementioned
  * requirements).
+ *
+ * this is needed for every packet sent or received, so the address is
+ * found only once per connection:  the address the mysocket was bound to,
+ * if it was bound to a specific one, or else whichever address the kernel
+ * routes packets to the peer from.  the peer sees the same address as
+ * ours, so both ends' checksums cover the same pseudo-header.
  */
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
@@ -25,7 +31,29 @@ uint32_t _network_get_local_addr(network_context_t *ctx)
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    if (!__atomic_load_n(&ctx->local_ip_valid, __ATOMIC_ACQUIRE))
+    {
+        const struct sockaddr_in *bound =
+            (const struct sockaddr_in *) &ctx->local_addr;
+        uint32_t peer_ip =
+            ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr;
+        uint32_t local_ip = 0;
+
+        if (bound->sin_family == AF_INET &&
+            bound->sin_addr.s_addr != htonl(INADDR_ANY))
+        {
+            local_ip = bound->sin_addr.s_addr;
+        }
+        if (!local_ip)
+            local_ip = _network_get_route_ip(peer_ip);
+        if (!local_ip)
+            local_ip = _network_get_interface_ip(peer_ip);
+
+        /* racing threads would find the same address */
+        ctx->local_ip = local_ip;
+        __atomic_store_n(&ctx->local_ip_valid, TRUE, __ATOMIC_RELEASE);
+    }
+
+    return ctx->local_ip;
 }
 
@@ -9,6 +9,7 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
@@ -26,6 +27,21 @@ typedef struct
     /* local address, if known */
     struct sockaddr local_addr;
 
+    /* local port (network byte order), or 0 until it's first found by
+     * _network_get_port() once the socket is bound
+     */
+    uint16_t        local_port;
+
+    /* the local IP address used with this peer (see
+     * _network_get_local_addr()), and the sum of the checksum
+     * pseudo-header's addresses and protocol (see tcp_sum.c).  each is
+     * worked out once, the first time it's needed.
+     */
+    uint32_t        local_ip;
+    bool_t          local_ip_valid;
+    uint32_t        pseudo_sum;
+    bool_t          pseudo_sum_valid;
+
     /* address of peer */
     struct sockaddr peer_addr;
     socklen_t       peer_addr_len;
@@ -34,11 +50,11 @@ typedef struct
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
-    /* packet reordering/duplication simulation */
-    unsigned int random_seed;
-    bool_t       copied;
-    char         copy_buffer[MAX_IP_PAYLOAD_LEN];
-    size_t       copy_buf_len;
+    /* loss/duplication/reordering/delay emulation (see network_emu.h);
+     * set up when the connection first sends.
+     */
+    struct network_emu_state *emu;
+    bool_t                    emu_started;
 } network_context_t;
 
 
@@ -52,11 +68,14 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 /* specify backlog for passive socket */
 int _network_listen(network_context_t *ctx, int backlog);
 
-/* returns local port associated with mysocket, in network byte order */
+/* returns local port associated with mysocket, in network byte order.
+ * once the port is known, it's cached thereafter.
+ */
 int _network_get_port(network_context_t *ctx);
 
 /* returns local address associated with mysocket, in network byte order.
- * this is only valid once the peer is known.
+ * this is only valid once the peer is known; it's looked up the first
+ * time, and cached thereafter.
  */
 uint32_t _network_get_local_addr(network_context_t *ctx);
 
@@ -65,9 +84,21 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
-/* send an STCP packet to our peer */
+/* return the local address the kernel would send from to reach peer_addr
+ * (both in network byte order), or 0 if it can't be found.
+ */
+uint32_t _network_get_route_ip(uint32_t peer_addr);
+
+/* send an STCP packet, gathered from iovcnt buffers, to our peer */
 ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len);
+                             const struct iovec *iov, int iovcnt);
+
+/* send count packets to our peer in one go, the i'th gathered from the
+ * next iovcnts[i] entries of iov.  returns the total bytes sent, or -1.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, const int *iovcnts,
+                              int count);
 
 /* start/stop per-mysocket network receive thread.  the stop() interface
  * must not return until the network receive thread has exited.
@@ -0,0 +1,891 @@
+/* network_io_shm.c: shared memory instantiation of the underlying datagram
+ * service.  packets between two mysockets, in the same process or in two
+ * processes on the same host, pass through a pair of single-producer,
+ * single-consumer rings in a shared memory segment, without touching the
+ * kernel's network stack.  this is Linux-only.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+/* a few words about the shared memory network layer...
+ *
+ *   - each mysocket still has a (never connected) TCP socket, purely to
+ *     reserve its port number.
+ *   - a listening mysocket also listens on a Unix domain socket in the
+ *     abstract namespace, named after its port (SHM_RENDEZVOUS_FMT).
+ *   - on an STCP SYN, the active side creates a segment holding a ring
+ *     for each direction, puts the SYN in its outgoing ring, then passes
+ *     the segment's descriptor (and its own address) to the listener over
+ *     the Unix domain socket.  that's the only use of the socket; the
+ *     listener maps the segment, dispatches the SYN to the right STCP
+ *     context, and the new context takes over the segment.
+ *   - rings hold whole packets, one per slot.  each side publishes its
+ *     progress with an atomic store, so neither blocks the other.  an
+ *     empty (or full) ring is waited for by spinning briefly, then
+ *     sleeping on a futex in the segment; the other side makes the
+ *     futex_wake() system call only if it sees that someone's asleep.
+ *   - a sender waits for room in a full ring rather than dropping the
+ *     packet, so (as with TCP) packets are delivered reliably and in
+ *     order.
+ */
+
+
+#define SHM_RENDEZVOUS_FMT  "stcp-shm.%u"   /* abstract Unix socket name */
+#define SHM_MAGIC           0x5354534dU     /* "STSM" */
+
+#define SHM_RING_SLOTS      256     /* a power of two */
+#define SHM_SPIN            1000    /* polls of a ring before sleeping */
+
+#define SHM_CACHE_LINE      64
+
+typedef struct
+{
+    uint16_t len;
+    char     data[MAX_IP_PAYLOAD_LEN];
+} shm_slot_t;
+
+/* the producer and consumer each write only their own cache line of the
+ * ring's indices.  head and tail are free-running; they double as the
+ * futex words the consumer (tail) and producer (head) sleep on.
+ */
+typedef struct shm_ring
+{
+    struct
+    {
+        uint32_t tail;
+        uint32_t waiting;   /* the producer is asleep on head */
+        uint32_t closed;    /* the producer has gone */
+    } __attribute__((aligned(SHM_CACHE_LINE))) producer;
+
+    struct
+    {
+        uint32_t head;
+        uint32_t waiting;   /* the consumer is asleep on tail */
+        uint32_t closed;    /* the consumer has gone */
+    } __attribute__((aligned(SHM_CACHE_LINE))) consumer;
+
+    shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+/* ring[0] carries packets from the active side to the passive side, and
+ * ring[1] those in the other direction.
+ */
+typedef struct shm_segment
+{
+    uint32_t   magic;
+    shm_ring_t ring[2];
+} shm_segment_t;
+
+/* sent by the active side with the segment's descriptor */
+typedef struct
+{
+    uint32_t           magic;
+    struct sockaddr_in addr;    /* the active side's */
+} shm_hello_t;
+
+
+static int _shm_connect(network_context_t *ctx);
+static int _shm_rendezvous(network_context_t *ctx, int segment_fd);
+static shm_segment_t *_shm_map_segment(int segment_fd);
+static void _shm_attach(network_context_socket_shm_t *shm_io_ctx,
+                        shm_segment_t *segment, bool_t is_active);
+static void _shm_detach(shm_segment_t *segment,
+                        shm_ring_t *rx_ring, shm_ring_t *tx_ring);
+static void *_shm_recv_thread_func(void *arg_ptr);
+static void *_shm_listen_thread_func(void *arg_ptr);
+static void _shm_accept(mysock_context_t *ctx);
+static int _shm_ring_put(shm_ring_t *ring, const struct iovec *iov,
+                         int iovcnt, size_t len);
+static int _shm_ring_wait(shm_ring_t *ring);
+static void _shm_ring_advance(shm_ring_t *ring, uint32_t head);
+static int _shm_get_port(network_context_t *ctx);
+static void _shm_futex_wait(uint32_t *word, uint32_t value);
+static void _shm_futex_wake(uint32_t *word);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_STREAM,
+                                   sizeof(network_context_socket_shm_t))) < 0)
+        return rc;
+
+    shm_io_ctx = (network_context_socket_shm_t *) net_ctx->impl_data;
+    assert(shm_io_ctx);
+
+    shm_io_ctx->sock_ctx   = sock_ctx;
+    shm_io_ctx->connected  = FALSE;
+    shm_io_ctx->stopping   = FALSE;
+    shm_io_ctx->segment    = NULL;
+    shm_io_ctx->rx_ring    = shm_io_ctx->tx_ring = NULL;
+    shm_io_ctx->segment_fd = -1;
+    shm_io_ctx->rendezvous = -1;
+
+    PTHREAD_CALL(pthread_mutex_init(&shm_io_ctx->send_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&shm_io_ctx->connect_cond, NULL));
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    if (shm_io_ctx->segment)
+    {
+        _shm_detach(shm_io_ctx->segment,
+                    shm_io_ctx->rx_ring, shm_io_ctx->tx_ring);
+        shm_io_ctx->segment = NULL;
+    }
+
+    if (shm_io_ctx->rendezvous != -1)
+        closesocket(shm_io_ctx->rendezvous);
+
+    PTHREAD_CALL(pthread_cond_destroy(&shm_io_ctx->connect_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&shm_io_ctx->send_lock));
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* listen for connections on the Unix domain socket named by our port */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    struct sockaddr_un sun;
+    socklen_t sun_len;
+    socket_t sd;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx && shm_io_ctx->rendezvous == -1);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    sun_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+              sprintf(sun.sun_path + 1, SHM_RENDEZVOUS_FMT,
+                      ntohs(_shm_get_port(ctx)));
+
+    if ((sd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+        return -1;
+
+    if (bind(sd, (struct sockaddr *) &sun, sun_len) < 0 ||
+        listen(sd, backlog) < 0)
+    {
+        perror("bind/listen (_network_listen)");
+        closesocket(sd);
+        return -1;
+    }
+
+    shm_io_ctx->rendezvous = sd;
+    return 0;
+}
+
+/* the new context takes over the segment (passed as user_data) that the
+ * SYN arrived on.  its socket is replaced by a copy of the listener's, so
+ * that it has the same port.
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_shm_t *new_shm_ctx;
+
+    assert(new_ctx && accept_ctx && syn_packet && user_data);
+
+    new_shm_ctx = (network_context_socket_shm_t *) new_ctx->impl_data;
+    assert(new_shm_ctx);
+
+    assert(!new_shm_ctx->sock_ctx->listening);
+    assert(!new_shm_ctx->sock_ctx->is_active);
+    closesocket(new_shm_ctx->base.socket);
+    if ((new_shm_ctx->base.socket = dup(GET_SOCKET(accept_ctx))) < 0)
+    {
+        assert(0);
+        abort();
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&new_shm_ctx->send_lock));
+    _shm_attach(new_shm_ctx, (shm_segment_t *) user_data, FALSE);
+    PTHREAD_CALL(pthread_mutex_unlock(&new_shm_ctx->send_lock));
+}
+
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+
+    net_ctx->recv_thread =
+        _mysock_create_thread(ctx->listening ? _shm_listen_thread_func
+                                             : _shm_recv_thread_func,
+                              ctx, FALSE);
+    net_ctx->recv_thread_started = TRUE;
+    return 0;
+}
+
+/* block until the network receive thread completes.  a connection's
+ * incoming ring is closed, so the peer won't wait for room in it.
+ */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx =
+        (network_context_socket_shm_t *) ctx->network_state.impl_data;
+
+    DEBUG_LOG(("stopping receive thread\n"));
+    assert(shm_io_ctx);
+
+    if (shm_io_ctx->base.recv_thread_started)
+    {
+        if (ctx->listening)
+        {
+            char dummy = 'X';
+
+            if (write(shm_io_ctx->base.exit_pipe[EXIT_PIPE_WRITE_INDEX],
+                      &dummy, sizeof(dummy)) < 0)
+            {
+                assert(0);
+                abort();
+            }
+        }
+        else
+        {
+            shm_ring_t *rx_ring;
+
+            PTHREAD_CALL(pthread_mutex_lock(&shm_io_ctx->send_lock));
+            shm_io_ctx->stopping = TRUE;
+            if ((rx_ring = shm_io_ctx->rx_ring) != NULL)
+            {
+                __atomic_store_n(&rx_ring->consumer.closed, 1,
+                                 __ATOMIC_SEQ_CST);
+                _shm_futex_wake(&rx_ring->producer.tail);
+                _shm_futex_wake(&rx_ring->consumer.head);
+            }
+            PTHREAD_CALL(pthread_cond_broadcast(&shm_io_ctx->connect_cond));
+            PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->send_lock));
+        }
+
+        PTHREAD_CALL(pthread_join(shm_io_ctx->base.recv_thread, NULL));
+        shm_io_ctx->base.recv_thread_started = FALSE;
+    }
+    DEBUG_LOG(("stopped receive thread\n"));
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, &iovcnt, 1);
+}
+
+/* put count packets in the peer's ring; the i'th packet is gathered from
+ * the next iovcnts[i] entries of iov.  the first packet sent by the active
+ * side (its SYN) sets up the connection.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, const int *iovcnts,
+                              int count)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    size_t total = 0;
+    int rc = 0, k, j;
+
+    assert(ctx && iov && iovcnts && count > 0);
+    assert(ctx->peer_addr_len > 0);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_io_ctx->send_lock));
+    if (!shm_io_ctx->segment && (rc = _shm_connect(ctx)) < 0)
+        goto done;
+
+    for (k = 0; k < count && rc == 0; ++k)
+    {
+        size_t len = 0;
+
+        assert(iovcnts[k] > 0);
+        for (j = 0; j < iovcnts[k]; ++j)
+            len += iov[j].iov_len;
+        assert(len <= MAX_IP_PAYLOAD_LEN);
+
+        if ((rc = _shm_ring_put(shm_io_ctx->tx_ring,
+                                iov, iovcnts[k], len)) == 0)
+            total += len;
+        iov += iovcnts[k];
+    }
+
+    /* the listener is told about the segment once the SYN's in it */
+    if (rc == 0 && !shm_io_ctx->connected)
+    {
+        assert(shm_io_ctx->sock_ctx->is_active);
+        rc = _shm_rendezvous(ctx, shm_io_ctx->segment_fd);
+        closesocket(shm_io_ctx->segment_fd);
+        shm_io_ctx->segment_fd = -1;
+
+        if (rc == 0)
+        {
+            shm_io_ctx->connected = TRUE;
+            PTHREAD_CALL(pthread_cond_broadcast(&shm_io_ctx->connect_cond));
+        }
+        else
+        {
+            _shm_detach(shm_io_ctx->segment, NULL, NULL);
+            shm_io_ctx->segment = NULL;
+            shm_io_ctx->rx_ring = shm_io_ctx->tx_ring = NULL;
+        }
+    }
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->send_lock));
+    return (rc < 0) ? -1 : (ssize_t) total;
+}
+
+
+/* create the segment for a new connection.  assumes send_lock is held. */
+static int _shm_connect(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    shm_segment_t *segment;
+    int segment_fd;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx && !shm_io_ctx->segment);
+    assert(ctx->peer_addr_valid);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    if (!shm_io_ctx->sock_ctx->is_active)
+    {
+        /* the passive side only ever sends on the segment it was given */
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if ((segment_fd = memfd_create("stcp-shm", MFD_CLOEXEC)) < 0)
+    {
+        perror("memfd_create (_shm_connect)");
+        return -1;
+    }
+
+    if (ftruncate(segment_fd, sizeof(shm_segment_t)) < 0 ||
+        !(segment = _shm_map_segment(segment_fd)))
+    {
+        perror("ftruncate/mmap (_shm_connect)");
+        closesocket(segment_fd);
+        return -1;
+    }
+
+    segment->magic = SHM_MAGIC;
+    shm_io_ctx->segment_fd = segment_fd;
+    _shm_attach(shm_io_ctx, segment, TRUE);
+    return 0;
+}
+
+/* pass the segment to the listener on the peer's port, along with our
+ * address.
+ */
+static int _shm_rendezvous(network_context_t *ctx, int segment_fd)
+{
+    struct sockaddr_un sun;
+    socklen_t sun_len;
+    shm_hello_t hello;
+    struct iovec iov;
+    struct msghdr msg;
+    union
+    {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    socket_t sd;
+    int rc = -1;
+
+    assert(ctx);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    sun_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+              sprintf(sun.sun_path + 1, SHM_RENDEZVOUS_FMT,
+                      ntohs(((struct sockaddr_in *) &ctx->peer_addr)->
+                            sin_port));
+
+    /* the listener takes this as our address, so it must be the one we
+     * checksum our segments with, not the (unconnected) socket's
+     */
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = SHM_MAGIC;
+    hello.addr.sin_family      = AF_INET;
+    hello.addr.sin_port        = _shm_get_port(ctx);
+    hello.addr.sin_addr.s_addr = _network_get_local_addr(ctx);
+    if (hello.addr.sin_port == 0)
+    {
+        assert(0);
+        return -1;
+    }
+
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &segment_fd, sizeof(int));
+
+    if ((sd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+        return -1;
+
+    DEBUG_LOG(("_shm_rendezvous (my_sd=%d): connecting to %s...\n",
+               ((network_context_socket_shm_t *) ctx->impl_data)->
+                   sock_ctx->my_sd, sun.sun_path + 1));
+    if (connect(sd, (struct sockaddr *) &sun, sun_len) < 0)
+        perror("connect (_shm_rendezvous)");
+    else if (sendmsg(sd, &msg, MSG_NOSIGNAL) < 0)
+        perror("sendmsg (_shm_rendezvous)");
+    else
+        rc = 0;
+
+    closesocket(sd);
+    return rc;
+}
+
+static shm_segment_t *_shm_map_segment(int segment_fd)
+{
+    void *p = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, segment_fd, 0);
+
+    return (p == MAP_FAILED) ? NULL : (shm_segment_t *) p;
+}
+
+/* make the segment the context's connection.  assumes send_lock is held
+ * (or that the context isn't in use yet).
+ */
+static void _shm_attach(network_context_socket_shm_t *shm_io_ctx,
+                        shm_segment_t *segment, bool_t is_active)
+{
+    assert(shm_io_ctx && segment && !shm_io_ctx->segment);
+
+    shm_io_ctx->segment = segment;
+    shm_io_ctx->tx_ring = &segment->ring[is_active ? 0 : 1];
+    shm_io_ctx->rx_ring = &segment->ring[is_active ? 1 : 0];
+    shm_io_ctx->connected = !is_active;
+    PTHREAD_CALL(pthread_cond_broadcast(&shm_io_ctx->connect_cond));
+}
+
+/* let the peer know we've gone from whichever of the rings we used, and
+ * unmap the segment.
+ */
+static void _shm_detach(shm_segment_t *segment,
+                        shm_ring_t *rx_ring, shm_ring_t *tx_ring)
+{
+    assert(segment);
+
+    if (rx_ring)
+    {
+        __atomic_store_n(&rx_ring->consumer.closed, 1, __ATOMIC_SEQ_CST);
+        _shm_futex_wake(&rx_ring->consumer.head);
+    }
+
+    if (tx_ring)
+    {
+        __atomic_store_n(&tx_ring->producer.closed, 1, __ATOMIC_SEQ_CST);
+        _shm_futex_wake(&tx_ring->producer.tail);
+    }
+
+    if (munmap(segment, sizeof(shm_segment_t)) < 0)
+        assert(0);
+}
+
+/* process network input, as in network_io_tcp.c.  packets are taken from
+ * the incoming ring a batch at a time, and copied into buffers for the
+ * transport layer.
+ */
+static void *_shm_recv_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx;
+    network_context_socket_shm_t *shm_io_ctx;
+    shm_ring_t *ring;
+
+    DEBUG_LOG(("started receive thread\n"));
+    ctx = (mysock_context_t *) arg_ptr;
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->network_state.impl_data;
+    assert(shm_io_ctx);
+
+    /* the active side has no segment until it sends its SYN */
+    PTHREAD_CALL(pthread_mutex_lock(&shm_io_ctx->send_lock));
+    while (!shm_io_ctx->connected && !shm_io_ctx->stopping)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&shm_io_ctx->connect_cond,
+                                       &shm_io_ctx->send_lock));
+    }
+    ring = shm_io_ctx->rx_ring;
+    if (shm_io_ctx->stopping)
+        ring = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->send_lock));
+
+    while (ring && _shm_ring_wait(ring) == 0)
+    {
+        mysock_buf_t *bufs[32];
+        struct iovec slices[32];
+        uint32_t head, tail;
+        int k;
+
+        head = ring->consumer.head;
+        tail = __atomic_load_n(&ring->producer.tail, __ATOMIC_ACQUIRE);
+
+        for (k = 0; k < (int) ARRAY_DIM(bufs) && head != tail; ++k, ++head)
+        {
+            const shm_slot_t *slot = &ring->slots[head & (SHM_RING_SLOTS - 1)];
+
+            assert(slot->len <= MYSOCK_BUF_SIZE);
+            bufs[k] = _mysock_buf_alloc(slot->len);
+            memcpy(bufs[k]->data, slot->data, slot->len);
+            slices[k].iov_base = bufs[k]->data;
+            slices[k].iov_len  = slot->len;
+        }
+
+        _shm_ring_advance(ring, head);
+
+        /* the queue takes over our references to the buffers */
+        _mysock_enqueue_refs(ctx, &ctx->network_recv_queue, bufs, slices, k);
+    }
+
+    return NULL;
+}
+
+/* wait for connections on a listening mysocket's Unix domain socket */
+static void *_shm_listen_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx;
+    network_context_socket_shm_t *shm_io_ctx;
+    bool_t done = FALSE;
+
+    DEBUG_LOG(("started listen thread\n"));
+    ctx = (mysock_context_t *) arg_ptr;
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->network_state.impl_data;
+    assert(shm_io_ctx && shm_io_ctx->rendezvous != -1);
+
+    while (!done)
+    {
+        struct pollfd fds[] =
+        {
+            { shm_io_ctx->base.exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
+            { shm_io_ctx->rendezvous, POLLIN, 0 }
+        };
+
+        switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
+        {
+        case -1:
+            assert(errno == EINTR);
+            break;
+
+        case 0:
+            assert(0);
+            break;
+
+        default:
+            assert(!(fds[0].revents & POLLERR));
+            assert(!(fds[1].revents & POLLERR));
+
+            if (fds[0].revents)
+                done = TRUE;
+            else if (fds[1].revents)
+                _shm_accept(ctx);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* accept a connection on the Unix domain socket, and dispatch the SYN
+ * waiting in the segment it brings.
+ */
+static void _shm_accept(mysock_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    shm_segment_t *segment = NULL;
+    shm_ring_t *ring;
+    shm_hello_t hello;
+    struct iovec iov;
+    struct msghdr msg;
+    union
+    {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    socket_t sd;
+    int segment_fd = -1;
+    ssize_t rc;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->network_state.impl_data;
+    assert(shm_io_ctx);
+
+    if ((sd = accept(shm_io_ctx->rendezvous, NULL, NULL)) < 0)
+    {
+        perror("accept (network_io_shm)");
+        return;
+    }
+
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    rc = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+    closesocket(sd);
+
+    cmsg = (rc > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    {
+        memcpy(&segment_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (segment_fd < 0 || rc != sizeof(hello) || hello.magic != SHM_MAGIC ||
+        fstat(segment_fd, &st) < 0 || st.st_size != sizeof(shm_segment_t) ||
+        !(segment = _shm_map_segment(segment_fd)) ||
+        segment->magic != SHM_MAGIC)
+    {
+        DEBUG_LOG(("_shm_accept:  dropping malformed connection request\n"));
+        if (segment)
+            _shm_detach(segment, NULL, NULL);
+        if (segment_fd >= 0)
+            closesocket(segment_fd);
+        return;
+    }
+    closesocket(segment_fd);
+
+    /* the SYN was put in the ring before we heard about it */
+    ring = &segment->ring[0];
+    if (__atomic_load_n(&ring->producer.tail, __ATOMIC_ACQUIRE) !=
+        ring->consumer.head)
+    {
+        const shm_slot_t *slot =
+            &ring->slots[ring->consumer.head & (SHM_RING_SLOTS - 1)];
+        char packet[MAX_IP_PAYLOAD_LEN];
+        size_t packet_len = MIN(slot->len, sizeof(packet));
+
+        memcpy(packet, slot->data, packet_len);
+        _shm_ring_advance(ring, ring->consumer.head + 1);
+
+        DEBUG_LOG(("accepted from peer %s:%d...\n",
+                   inet_ntoa(hello.addr.sin_addr),
+                   (int) ntohs(hello.addr.sin_port)));
+        if (_mysock_enqueue_connection(ctx, packet, packet_len,
+                                       (struct sockaddr *) &hello.addr,
+                                       sizeof(hello.addr), segment))
+        {
+            return;     /* the new mysocket has the segment */
+        }
+    }
+
+    /* the peer's stuck with a connection nobody's listening to */
+    _shm_detach(segment, &segment->ring[0], &segment->ring[1]);
+}
+
+/* copy a packet into the ring, waiting for room if it's full.  returns 0,
+ * or -1 (with errno EPIPE) if the consumer has gone.
+ */
+static int _shm_ring_put(shm_ring_t *ring, const struct iovec *iov,
+                         int iovcnt, size_t len)
+{
+    shm_slot_t *slot;
+    uint32_t head, tail;
+    char *p;
+    int spins, j;
+
+    assert(ring && iov && len <= MAX_IP_PAYLOAD_LEN);
+
+    tail = ring->producer.tail;
+    for (spins = 0; ; ++spins)
+    {
+        if (__atomic_load_n(&ring->consumer.closed, __ATOMIC_ACQUIRE))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        head = __atomic_load_n(&ring->consumer.head, __ATOMIC_ACQUIRE);
+        if (tail - head < SHM_RING_SLOTS)
+            break;
+        if (spins < SHM_SPIN)
+            continue;
+
+        __atomic_store_n(&ring->producer.waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->consumer.head, __ATOMIC_SEQ_CST) == head &&
+            !__atomic_load_n(&ring->consumer.closed, __ATOMIC_SEQ_CST))
+        {
+            _shm_futex_wait(&ring->consumer.head, head);
+        }
+        __atomic_store_n(&ring->producer.waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    slot = &ring->slots[tail & (SHM_RING_SLOTS - 1)];
+    slot->len = len;
+    for (p = slot->data, j = 0; j < iovcnt; ++j)
+    {
+        memcpy(p, iov[j].iov_base, iov[j].iov_len);
+        p += iov[j].iov_len;
+    }
+
+    __atomic_store_n(&ring->producer.tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer.waiting, __ATOMIC_SEQ_CST))
+        _shm_futex_wake(&ring->producer.tail);
+    return 0;
+}
+
+/* wait for a packet in the ring.  returns 0, or -1 once the producer's
+ * gone (and the ring is empty), or we've stopped reading it.
+ */
+static int _shm_ring_wait(shm_ring_t *ring)
+{
+    uint32_t head, tail;
+    int spins;
+
+    assert(ring);
+
+    head = ring->consumer.head;
+    for (spins = 0; ; ++spins)
+    {
+        if (__atomic_load_n(&ring->consumer.closed, __ATOMIC_ACQUIRE))
+            return -1;
+
+        tail = __atomic_load_n(&ring->producer.tail, __ATOMIC_ACQUIRE);
+        if (tail != head)
+            return 0;
+        if (__atomic_load_n(&ring->producer.closed, __ATOMIC_ACQUIRE))
+            return -1;
+        if (spins < SHM_SPIN)
+            continue;
+
+        __atomic_store_n(&ring->consumer.waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->producer.tail, __ATOMIC_SEQ_CST) == tail &&
+            !__atomic_load_n(&ring->producer.closed, __ATOMIC_SEQ_CST) &&
+            !__atomic_load_n(&ring->consumer.closed, __ATOMIC_SEQ_CST))
+        {
+            _shm_futex_wait(&ring->producer.tail, tail);
+        }
+        __atomic_store_n(&ring->consumer.waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* release the ring's slots up to head to the producer */
+static void _shm_ring_advance(shm_ring_t *ring, uint32_t head)
+{
+    assert(ring);
+
+    __atomic_store_n(&ring->consumer.head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer.waiting, __ATOMIC_SEQ_CST))
+        _shm_futex_wake(&ring->consumer.head);
+}
+
+/* our port (network byte order), binding the socket to one first if need
+ * be
+ */
+static int _shm_get_port(network_context_t *ctx)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+
+    assert(ctx);
+
+    if (ctx->local_port)
+        return ctx->local_port;
+
+    if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
+        return 0;
+
+    if (sin.sin_port == 0)
+    {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        if (bind(GET_SOCKET(ctx), (struct sockaddr *) &sin, sizeof(sin)) < 0)
+            return 0;
+    }
+
+    return _network_get_port(ctx);
+}
+
+static void _shm_futex_wait(uint32_t *word, uint32_t value)
+{
+    if (syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0) < 0)
+        assert(errno == EAGAIN || errno == EINTR);
+}
+
+static void _shm_futex_wake(uint32_t *word)
+{
+    (void) syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
@@ -2,12 +2,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <unistd.h>
-#include <poll.h>
 #include <assert.h>
 #include <net/if.h> 
 #include <sys/ioctl.h>
@@ -17,7 +15,6 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
-#include "connection_demux.h"
 
 #include <string.h>
 #include <netinet/in.h>
@@ -25,10 +22,6 @@
 #include <netdb.h>
 
 
-
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
-
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
 #define MAXHOSTNAMELEN HOST_NAME_MAX
@@ -41,7 +34,6 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
-static void *network_recv_thread_func(void *arg_ptr);
 
 
 
@@ -62,8 +54,14 @@ int _network_get_port(network_context_t *ctx)
 {
     struct sockaddr_in sin;
     socklen_t sin_len = sizeof(sin);
+    uint16_t port;
 
     assert(ctx);
+
+    /* a socket's port never changes once it's bound */
+    if ((port = __atomic_load_n(&ctx->local_port, __ATOMIC_RELAXED)) != 0)
+        return port;
+
     VERIFY_SOCKET(ctx);
 
     if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
@@ -73,6 +71,7 @@ int _network_get_port(network_context_t *ctx)
     }
 
     assert(sin.sin_family == AF_INET);
+    __atomic_store_n(&ctx->local_port, sin.sin_port, __ATOMIC_RELAXED);
     return sin.sin_port;
 }
 
@@ -146,53 +145,35 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
-int _network_start_recv_thread(mysock_context_t *ctx)
-{
-    network_context_socket_t *net_ctx =
-        (network_context_socket_t *) ctx->network_state.impl_data;
-
-    assert(net_ctx);
-
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-    {
-        perror("signal(SIGPIPE)");
-        assert(0);
-        return -1;
-    }
-
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
-    return 0;
-}
-
-/* block until the network receive thread completes */
-void _network_stop_recv_thread(mysock_context_t *ctx)
+/* return the local address the kernel would send from to reach peer_addr,
+ * by connecting a UDP socket (which sends nothing) and asking it.  unlike
+ * _network_get_interface_ip(), this works for multi-homed hosts, and
+ * gives the loopback address for a peer on the loopback interface.
+ */
+uint32_t _network_get_route_ip(uint32_t peer_addr)
 {
-    network_context_socket_t *net_ctx =
-        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    uint32_t local_ip = 0;
+    int sd;
 
-    DEBUG_LOG(("stopping receive thread\n"));
-    assert(net_ctx);
+    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return 0;
 
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = peer_addr;
+    sin.sin_port        = htons(9);     /* any port will do */
 
-    if (net_ctx->recv_thread_started)
+    if (connect(sd, (struct sockaddr *) &sin, sizeof(sin)) == 0 &&
+        getsockname(sd, (struct sockaddr *) &sin, &sin_len) == 0)
     {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
-        {
-            assert(0);
-            abort();
-        }
-
-
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
+        local_ip = sin.sin_addr.s_addr;
     }
-    DEBUG_LOG(("stopped receive thread\n"));
-}
 
+    closesocket(sd);
+    return local_ip;
+}
 
 /* initialise the network subsystem.  this function should be called before
  * making use of any of the other network layer functions.
@@ -206,7 +187,6 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
     assert(ctx_len >= sizeof(network_context_socket_t));
 
     memset(net_ctx, 0, sizeof(*net_ctx));
-    net_ctx->random_seed = 0x632a;
 
     if (!(net_ctx->impl_data = _network_alloc_context_socket(type, ctx_len)))
     {
@@ -228,103 +208,6 @@ int _network_bind_socket(network_context_t *ctx,
 }
 
 
-/* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
- * this runs in its own thread, mostly because the transport layer needs to
- * wait with a timeout for incoming data from the peer.  [usual mechanisms
- * for I/O with timeouts such as poll(), select(), or asynchronous I/O
- * don't work with all underlying I/O mechanisms we might support (e.g.
- * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
- */
-static void *network_recv_thread_func(void *arg_ptr)
-{
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
-    network_context_socket_t *net_ctx;
-
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
-    assert(ctx);
-
-    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
-    assert(net_ctx);
-
-    for (;;)
-    {
-        ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
-        {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
-
-
-        while (!packet_ready && !done)
-        {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
-            {
-            case -1:
-                assert(errno == EINTR);
-                break;
-
-            case 0:
-                assert(0);
-                break;
-
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
-
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
-            }
-        }
-
-        if (done)
-            break;
-
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
-        {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            break;
-        }
-
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
-        {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
-             */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
-        }
-        else
-        {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
-        }
-    }
-
-    return NULL;
-}
-
 static network_context_socket_t *
 _network_alloc_context_socket(int socket_type, size_t ctx_len)
 {
@@ -334,6 +217,11 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
     assert(ctx);
 
 
+    ctx->socket = -1;
+    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
+    if (socket_type == 0)
+        return ctx;     /* the I/O layer supplies the socket */
+
     /* create the actual socket used for communication to the peer */
     if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
     {
@@ -343,7 +231,6 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         ctx = NULL;
     }
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
     if (pipe(ctx->exit_pipe) < 0)
     {
         perror("pipe");
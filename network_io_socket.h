@@ -16,6 +16,9 @@
 
 typedef int socket_t;
 
+#define EXIT_PIPE_READ_INDEX  0
+#define EXIT_PIPE_WRITE_INDEX 1
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
@@ -28,7 +31,17 @@ typedef struct
     int                exit_pipe[2];    /* used to wake up read thread */
 } network_context_socket_t;
 
-typedef network_context_socket_t network_context_socket_udp_t;
+struct udp_endpoint;
+
+typedef struct
+{
+    network_context_socket_t base;  /* base.socket is the endpoint's */
+
+    /* additional state required by UDP-based network layer */
+    mysock_context_t    *sock_ctx;
+    struct udp_endpoint *endpoint;  /* shared socket, once bound */
+    bool_t               registered;    /* in the connection table */
+} network_context_socket_udp_t;
 
 typedef struct
 {
@@ -38,9 +51,53 @@ typedef struct
     mysock_context_t *sock_ctx;
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
-    bool_t            connected;
+    bool_t            connected;    /* read without connect_lock once set */
+    bool_t            connecting;   /* connect() in progress */
+    unsigned int      connect_attempt;  /* bumped by each connect() */
+
+    /* input read from the socket but not yet returned as packets.  the
+     * unparsed data is recv_buf[recv_start..recv_end); recv_skip bytes of
+     * an oversized frame remain to be discarded.
+     */
+    char             *recv_buf;
+    size_t            recv_start, recv_end;
+    size_t            recv_skip;
 } network_context_socket_tcp_t;
 
+struct uring_conn;
+struct uring_listener;
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by io_uring-based network layer */
+    mysock_context_t      *sock_ctx;
+    pthread_mutex_t        connect_lock;
+    bool_t                 connected;
+    struct uring_conn     *conn;        /* the connection's stream */
+    struct uring_listener *listener;    /* accept()s, if listening */
+} network_context_socket_uring_t;
+
+struct shm_segment;
+struct shm_ring;
+
+typedef struct
+{
+    network_context_socket_t base;  /* base.socket just reserves the port */
+
+    /* additional state required by shared memory network layer */
+    mysock_context_t   *sock_ctx;
+    pthread_mutex_t     send_lock;      /* serialises the ring's producers */
+    pthread_cond_t      connect_cond;   /* signalled once connected */
+    bool_t              connected;
+    bool_t              stopping;       /* the receive thread is to exit */
+    struct shm_segment *segment;        /* the connection's rings */
+    struct shm_ring    *rx_ring, *tx_ring;
+    int                 segment_fd;     /* until the listener has it */
+    socket_t            rendezvous;     /* if listening */
+} network_context_socket_shm_t;
+
 
 #define closesocket(s) close(s)
 
@@ -57,6 +114,11 @@ typedef struct
 #endif
 
 
+/* allocate ctx_len bytes of I/O layer state, starting with a
+ * network_context_socket_t, with a new socket of the given type.  if type
+ * is zero, no socket (or exit pipe) is created; the I/O layer supplies
+ * its own.
+ */
 int _network_init_socket(mysock_context_t  *sock_ctx,
                          network_context_t *net_ctx,
                          int                type,
@@ -69,12 +131,5 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen);
 
 
-/* this is not called directly.  use network_start_recv_thread() and
- * network_stop_recv_thread() instead.
- */
-ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
-
-
 #endif  /* __NETWORK_IO_SOCKET_H__ */
 
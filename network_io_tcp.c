@@ -3,22 +3,50 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <alloca.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
+#include "connection_demux.h"
 
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
+/* longest a thread waits for connect() to complete, in milliseconds,
+ * rather than the kernel's SYN timeout of a couple of minutes
+ */
+#define TCP_CONNECT_TIMEOUT 10000
+
+/* size of each connection's receive buffer.  frames are read from the
+ * socket this much at a time, so a single read() usually picks up several.
+ */
+#define TCP_RECV_BUF_SIZE (64 * 1024)
+
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static int _tcp_finish_connect(network_context_t *ctx, unsigned int attempt);
+static void *_tcp_recv_thread_func(void *arg_ptr);
+static ssize_t _tcp_recv_packet(network_context_t *ctx,
+                                void *dst, size_t max_len);
+static bool_t _tcp_packet_buffered(network_context_t *ctx, size_t max_len);
+static ssize_t _tcp_recv_buffered(network_context_socket_tcp_t *tcp_io_ctx,
+                                  void *dst, size_t max_len);
+static ssize_t _tcp_recv_unbuffered(socket_t io_socket,
+                                    void *dst, size_t max_len);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -57,6 +85,12 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     tcp_io_ctx->sock_ctx = sock_ctx;
     tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    tcp_io_ctx->connecting = FALSE;
+
+    tcp_io_ctx->recv_buf = (char *) malloc(TCP_RECV_BUF_SIZE);
+    assert(tcp_io_ctx->recv_buf);
+    tcp_io_ctx->recv_start = tcp_io_ctx->recv_end = 0;
+    tcp_io_ctx->recv_skip = 0;
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
 
@@ -80,6 +114,7 @@ void _network_close(network_context_t *ctx)
     }
 
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
+    free(tcp_io_ctx->recv_buf);
 
     _network_close_socket(ctx);
 }
@@ -130,15 +165,79 @@ void _network_update_passive_state(network_context_t *new_ctx,
                new_tcp_ctx->base.socket));
 }
 
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+        return -1;
+    }
+
+    net_ctx->recv_thread = _mysock_create_thread(_tcp_recv_thread_func,
+                                                 ctx, FALSE);
+    net_ctx->recv_thread_started = TRUE;
+    return 0;
+}
+
+/* block until the network receive thread completes */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    DEBUG_LOG(("stopping receive thread\n"));
+    assert(net_ctx);
+
+
+    if (net_ctx->recv_thread_started)
+    {
+        char dummy = 'X';
+        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
+                  &dummy, sizeof(dummy)) < 0)
+        {
+            assert(0);
+            abort();
+        }
 
-/* send the given packet to the peer */
+
+        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
+        net_ctx->recv_thread_started = FALSE;
+    }
+    DEBUG_LOG(("stopped receive thread\n"));
+}
+
+/* send the given packet to the peer.  the length prefix and the packet
+ * fragments go to the kernel in a single writev(), so the emulated
+ * datagram isn't split across TCP segments (and held back by Nagle's
+ * algorithm waiting for the peer's delayed ACK).
+ */
 ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len)
+                             const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, &iovcnt, 1);
+}
+
+/* send count packets to the peer; the i'th packet is gathered from the
+ * next iovcnts[i] entries of iov.  each is framed with its own length
+ * prefix, and the whole batch is written with a single writev().
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, const int *iovcnts,
+                              int count)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;    /* network byte order */
+    uint16_t *packet_lens;  /* network byte order */
+    struct iovec *out_iov;
+    size_t total = 0;
+    int out_cnt = 0, k, j;
 
-    assert(ctx && src);
+    assert(ctx && iov && iovcnts && count > 0);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,22 +249,162 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
-    packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    for (k = 0; k < count; ++k)
+        out_cnt += iovcnts[k] + 1;
+
+    packet_lens = (uint16_t *) alloca(count * sizeof(uint16_t));
+    out_iov = (struct iovec *) alloca(out_cnt * sizeof(struct iovec));
+
+    for (k = 0, out_cnt = 0; k < count; ++k)
+    {
+        struct iovec *prefix = &out_iov[out_cnt++];
+        size_t len = 0;
+
+        assert(iovcnts[k] > 0);
+        for (j = 0; j < iovcnts[k]; ++j)
+        {
+            out_iov[out_cnt++] = *iov;
+            len += iov->iov_len;
+            ++iov;
+        }
+        assert(len <= MAX_IP_PAYLOAD_LEN);
+
+        packet_lens[k]   = htons(len);
+        prefix->iov_base = &packet_lens[k];
+        prefix->iov_len  = sizeof(packet_lens[k]);
+        total += len;
+    }
+
+    if (_tcp_writev(GET_SOCKET(ctx), out_iov, out_cnt) < 0)
         return -1;
 
-    return len;
+    return total;
+}
+
+/* process network input.
+ * this just loops around, waiting for data to arrive, and buffering it
+ * for later consumption by network_recv().  (outgoing data is sent
+ * immediately via network_send(), and so does not require its own thread).
+ * 
+ * this runs in its own thread, mostly because the transport layer needs to
+ * wait with a timeout for incoming data from the peer.  [usual mechanisms
+ * for I/O with timeouts such as poll(), select(), or asynchronous I/O
+ * don't work with all underlying I/O mechanisms we might support (e.g.
+ * VNS).  so we implement the timeout in a more generic (I/O-independent)
+ * manner using the pthreads API instead].
+ */
+static void *_tcp_recv_thread_func(void *arg_ptr)
+{
+    mysock_buf_t *packet_buf = NULL;
+    mysock_context_t *ctx;
+    network_context_socket_t *net_ctx;
+
+    DEBUG_LOG(("started receive thread\n"));
+    ctx = (mysock_context_t *) arg_ptr;
+    assert(ctx);
+
+    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
+    assert(net_ctx);
+
+    for (;;)
+    {
+        ssize_t bytes_read;
+        bool_t packet_ready = FALSE;
+        bool_t done = FALSE;
+        struct pollfd fds[] =
+        {
+            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
+            { net_ctx->socket, POLLIN, 0 }
+        };
+
+
+        /* earlier reads may have left complete packets buffered, in which
+         * case the socket may never become readable again for them.
+         */
+        if (_tcp_packet_buffered(&ctx->network_state, MYSOCK_BUF_SIZE))
+            packet_ready = TRUE;
+
+        while (!packet_ready && !done)
+        {
+            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
+            {
+            case -1:
+                assert(errno == EINTR);
+                break;
+
+            case 0:
+                assert(0);
+                break;
+
+            default:
+                /* an error on the socket (e.g. a failed connect()) is
+                 * reported by the read.
+                 */
+                assert(!(fds[0].revents & POLLERR));
+
+                if (fds[0].revents)
+                    done = TRUE;
+                if (fds[1].revents)
+                    packet_ready = TRUE;
+                break;
+            }
+        }
+
+        if (done)
+            break;
+
+        /* block, waiting for network input.  (the system call will be
+         * interrupted by the transport layer thread if we're to exit).
+         */
+        /* packets are read straight into a pooled buffer, which is then
+         * queued for the transport layer without copying.
+         */
+        if (!packet_buf)
+            packet_buf = _mysock_buf_alloc(MYSOCK_BUF_SIZE);
+
+        if ((bytes_read = _tcp_recv_packet(&ctx->network_state,
+                                           packet_buf->data,
+                                           MYSOCK_BUF_SIZE)) <= 0)
+        {
+            DEBUG_LOG(("_tcp_recv_packet interrupted, errno=%d\n", errno));
+            break;
+        }
+
+        assert(bytes_read <= MYSOCK_BUF_SIZE);
+        if (ctx->listening)
+        {
+            /* if the socket was accepting new connections, incoming
+             * packets need to be demultiplexed and dispatched to the
+             * appropriate mysocket context.
+             */
+            _mysock_enqueue_connection(ctx, packet_buf->data, bytes_read,
+                                       &ctx->network_state.peer_addr,
+                                       ctx->network_state.peer_addr_len, NULL);
+        }
+        else
+        {
+            /* enqueue the packet directly for this context; the queue
+             * takes over our reference to the buffer.
+             */
+            struct iovec slice;
+
+            slice.iov_base = packet_buf->data;
+            slice.iov_len  = bytes_read;
+            _mysock_enqueue_refs(ctx, &ctx->network_recv_queue,
+                                 &packet_buf, &slice, 1);
+            packet_buf = NULL;
+        }
+    }
+
+    _mysock_buf_release(packet_buf);
+    return NULL;
 }
 
 /* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+static ssize_t _tcp_recv_packet(network_context_t *ctx,
+                                void *dst, size_t max_len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
 
     assert(ctx && dst);
 
@@ -174,7 +413,6 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
     assert(tcp_io_ctx->sock_ctx);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
     if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
         return -1;
@@ -202,19 +440,132 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
          */
         assert(tcp_io_ctx->new_socket == -1);
         tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+
+        DEBUG_PEER(ctx);
+
+        /* the new socket is handed on to another context once the SYN has
+         * been dispatched, so nothing beyond the SYN may be read here.
+         */
+        return _tcp_recv_unbuffered(tmp_sd, dst, max_len);
     }
 
     DEBUG_PEER(ctx);
 
 #ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    if (getpeername(GET_SOCKET(ctx), &ctx->peer_addr, &ctx->peer_addr_len) < 0)
     {
         DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
         return -1;
     }
 #endif
 
+    return _tcp_recv_buffered(tcp_io_ctx, dst, max_len);
+}
+
+/* TRUE if _tcp_recv_packet() can return a packet of up to max_len bytes
+ * from input that has already been read, without waiting for the socket.
+ */
+static bool_t _tcp_packet_buffered(network_context_t *ctx, size_t max_len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    size_t avail;
+    uint16_t packet_len;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+    if (tcp_io_ctx->recv_skip > 0 || avail < sizeof(packet_len))
+        return FALSE;
+
+    memcpy(&packet_len, tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+           sizeof(packet_len));
+    return avail >= sizeof(packet_len) + MIN(ntohs(packet_len), max_len);
+}
+
+
+/* return the next frame from the connection's receive buffer, refilling it
+ * from the socket as needed.  only the first max_len bytes of the frame
+ * are copied to dst; the rest is skipped.  returns the frame's length, or
+ * the result of the failed read().
+ */
+static ssize_t _tcp_recv_buffered(network_context_socket_tcp_t *tcp_io_ctx,
+                                  void *dst, size_t max_len)
+{
+    char *buf;
+
+    assert(tcp_io_ctx && tcp_io_ctx->recv_buf && dst);
+    assert(sizeof(uint16_t) + max_len <= TCP_RECV_BUF_SIZE);
+
+    buf = tcp_io_ctx->recv_buf;
+    for (;;)
+    {
+        size_t avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+        ssize_t rc;
+
+        /* discard what's arrived of the remainder of an oversized frame */
+        if (tcp_io_ctx->recv_skip > 0)
+        {
+            size_t n = MIN(tcp_io_ctx->recv_skip, avail);
+
+            tcp_io_ctx->recv_start += n;
+            tcp_io_ctx->recv_skip  -= n;
+            avail -= n;
+        }
+
+        if (tcp_io_ctx->recv_skip == 0 && avail >= sizeof(uint16_t))
+        {
+            uint16_t packet_len;
+            size_t copy_len, frame_len;
+
+            memcpy(&packet_len, buf + tcp_io_ctx->recv_start,
+                   sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            copy_len   = MIN(packet_len, max_len);
+            frame_len  = sizeof(packet_len) + packet_len;
+
+            if (avail >= sizeof(packet_len) + copy_len)
+            {
+                memcpy(dst, buf + tcp_io_ctx->recv_start + sizeof(packet_len),
+                       copy_len);
+                tcp_io_ctx->recv_start += MIN(frame_len, avail);
+                tcp_io_ctx->recv_skip   = frame_len - MIN(frame_len, avail);
+                return packet_len;
+            }
+        }
+
+        /* move any partial frame to the front, and read as much more as
+         * will fit.
+         */
+        if (tcp_io_ctx->recv_start > 0)
+        {
+            memmove(buf, buf + tcp_io_ctx->recv_start, avail);
+            tcp_io_ctx->recv_start = 0;
+            tcp_io_ctx->recv_end   = avail;
+        }
+
+        if ((rc = read(tcp_io_ctx->base.socket, buf + tcp_io_ctx->recv_end,
+                       TCP_RECV_BUF_SIZE - tcp_io_ctx->recv_end)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", (int) rc));
+            return rc;
+        }
+        tcp_io_ctx->recv_end += rc;
+    }
+}
+
+/* read a single frame from io_socket, without reading any further */
+static ssize_t _tcp_recv_unbuffered(socket_t io_socket,
+                                    void *dst, size_t max_len)
+{
+    uint16_t packet_len;
+    size_t remaining;
+    int rc;
+
+    assert(dst);
+
     if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
     {
         DEBUG_LOG(("couldn't read packet len: %d\n", rc));
@@ -228,17 +579,20 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
         return rc;
     }
 
-    if (packet_len > max_len)
+    /* discard unread remainder of packet */
+    for (remaining = packet_len - MIN(packet_len, max_len); remaining > 0; )
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        char dummy[512];
+        size_t n = MIN(remaining, sizeof(dummy));
+
+        if (_tcp_io(io_socket, dummy, n, read) <= 0)
+            break;
+        remaining -= n;
     }
 
     return packet_len;
 }
 
-
 /* read/write count bytes into/from buf */
 static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
 {
@@ -264,37 +618,168 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write all of the given buffers, resuming after short writes.  iov is
+ * modified.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    for (;;)
+    {
+        ssize_t rc;
+
+        /* skip buffers that have been written completely */
+        while (iovcnt > 0 && iov->iov_len == 0)
+        {
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt == 0)
+            return 0;
+
+        if ((rc = writev(tcp_sd, iov, MIN(iovcnt, IOV_MAX))) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return (rc < 0) ? -1 : 0;
+        }
+
+        for (; rc > 0; ++iov, --iovcnt)
+        {
+            if ((size_t) rc < iov->iov_len)
+            {
+                iov->iov_base = (char *) iov->iov_base + rc;
+                iov->iov_len -= rc;
+                break;
+            }
+            rc -= iov->iov_len;
+            iov->iov_len = 0;
+        }
+    }
+}
+
+/* connect to the peer, if we haven't already.  once the connection's
+ * established, this is just an atomic load of the connected flag.  the
+ * connect() itself is non-blocking, and its completion is waited for
+ * without holding connect_lock.
+ */
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+    unsigned int attempt;
 
     assert(ctx);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
+    if (__atomic_load_n(&tcp_io_ctx->connected, __ATOMIC_ACQUIRE))
+        return 0;
+
     PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
-    if (!tcp_io_ctx->connected)
+    if (tcp_io_ctx->connected)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+        return 0;
+    }
+    if (!tcp_io_ctx->connecting)
     {
+        int flags;
+
         assert(ctx->peer_addr_valid);
         assert(ctx->peer_addr.sa_family == AF_INET);
         assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
 
         DEBUG_LOG(("_tcp_connect (my_sd=%d): connecting on socket %d...\n",
                    tcp_io_ctx->sock_ctx->my_sd, (int)GET_SOCKET(ctx)));
-        if ((connect(GET_SOCKET(ctx), &ctx->peer_addr,
-                     sizeof(ctx->peer_addr))) < 0)
+        if ((flags = fcntl(GET_SOCKET(ctx), F_GETFL)) < 0 ||
+            fcntl(GET_SOCKET(ctx), F_SETFL, flags | O_NONBLOCK) < 0 ||
+            ((connect(GET_SOCKET(ctx), &ctx->peer_addr,
+                      sizeof(ctx->peer_addr))) < 0 && errno != EINPROGRESS))
         {
             perror("connect (_tcp_connect)");
             fprintf(stderr, "(errno=%d)\n", errno);
-	    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+            PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
             return -1;
         }
 
-        tcp_io_ctx->connected = TRUE;
+        tcp_io_ctx->connecting = TRUE;
+        ++tcp_io_ctx->connect_attempt;
     }
+    attempt = tcp_io_ctx->connect_attempt;
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
 
-    return 0;
+    return _tcp_finish_connect(ctx, attempt);
 }
 
+/* wait (for up to TCP_CONNECT_TIMEOUT) for the given connect() attempt to
+ * complete, and put the socket back into blocking mode if it succeeded.
+ * any number of threads may wait; whichever gets connect_lock first sees
+ * the result.
+ */
+static int _tcp_finish_connect(network_context_t *ctx, unsigned int attempt)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    struct pollfd pfd;
+    int rc = 0, ready;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    pfd.fd      = GET_SOCKET(ctx);
+    pfd.events  = POLLOUT;
+    pfd.revents = 0;
+    while ((ready = poll(&pfd, 1, TCP_CONNECT_TIMEOUT)) < 0)
+        assert(errno == EINTR);
+
+    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
+    if (!tcp_io_ctx->connected)
+    {
+        socklen_t err_len = sizeof(int);
+        int err = 0, flags;
+
+        if (!tcp_io_ctx->connecting ||
+            tcp_io_ctx->connect_attempt != attempt)
+        {
+            /* another thread found that our attempt failed (and another
+             * may since have started)
+             */
+            errno = ECONNREFUSED;
+            rc = -1;
+        }
+        else if (ready == 0)
+        {
+            /* give up on this attempt */
+            errno = ETIMEDOUT;
+            perror("connect (_tcp_finish_connect)");
+            errno = ETIMEDOUT;
+            tcp_io_ctx->connecting = FALSE;
+            rc = -1;
+        }
+        else if (getsockopt(GET_SOCKET(ctx), SOL_SOCKET, SO_ERROR,
+                            &err, &err_len) < 0 || err != 0 ||
+                 !(pfd.revents & POLLOUT) ||
+                 (pfd.revents & (POLLERR | POLLHUP)) ||
+                 (flags = fcntl(GET_SOCKET(ctx), F_GETFL)) < 0 ||
+                 fcntl(GET_SOCKET(ctx), F_SETFL, flags & ~O_NONBLOCK) < 0)
+        {
+            if (err == 0)
+                err = ((pfd.revents & (POLLOUT | POLLERR | POLLHUP)) ==
+                       POLLOUT) ? errno : ECONNREFUSED;
+            errno = err;
+            perror("connect (_tcp_finish_connect)");
+            fprintf(stderr, "(errno=%d)\n", err);
+            errno = err;
+            tcp_io_ctx->connecting = FALSE;
+            rc = -1;
+        }
+        else
+        {
+            tcp_io_ctx->connecting = FALSE;
+            __atomic_store_n(&tcp_io_ctx->connected, TRUE, __ATOMIC_RELEASE);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+
+    return rc;
+}
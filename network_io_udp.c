@@ -0,0 +1,744 @@
+/* network_io_udp.c: UDP instantiation of the underlying unreliable
+ * datagram service.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+/* a few words about the UDP network layer...
+ *
+ * each STCP packet is carried in a single UDP datagram, so any loss,
+ * duplication or reordering on the path is seen by STCP itself, rather
+ * than being hidden by the kernel's TCP.
+ *
+ * mysockets don't have a UDP socket each.  instead, there's one socket
+ * (an "endpoint") per local port, with a single receive thread, shared by
+ * every mysocket using that port:
+ *   - a listening mysocket's endpoint receives SYNs from connecting peers,
+ *     which are dispatched to new mysockets as in the TCP case.  the new
+ *     mysockets share the listener's endpoint.
+ *   - active mysockets binding an ephemeral port share an ephemeral
+ *     endpoint created by another active mysocket, as long as they're
+ *     connecting to different peers; a new endpoint is only needed for a
+ *     repeated peer.
+ * packets arriving at an endpoint are demultiplexed to connections by the
+ * peer's address and port and the local port (see connection_demux.c).
+ * anything that doesn't match an established connection is offered to the
+ * endpoint's listening mysocket, if any, as a connection request.  so the
+ * number of file descriptors and threads depends on the number of local
+ * ports in use, not the number of connections.
+ *
+ * on Linux, runs of equal-sized packets sent together (e.g. by
+ * stcp_network_send_many()) go to the kernel as a single UDP_SEGMENT
+ * (GSO) send, and endpoints ask for UDP_GRO, so a train of segments can
+ * arrive as one large datagram; the receive thread splits it up again.
+ */
+
+#if defined(LINUX) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define UDP_OFFLOAD
+#endif
+
+/* largest UDP payload, and so the largest GRO train */
+#define UDP_MAX_PAYLOAD 65507
+
+/* most segments the kernel accepts in one GSO send */
+#define UDP_GSO_MAX_SEGS 64
+
+
+typedef struct udp_endpoint
+{
+    struct udp_endpoint *next;          /* endpoint list linkage */
+    int                  refcnt;        /* mysockets bound to the endpoint */
+
+    uint16_t             port;          /* network byte order */
+    bool_t               shared;        /* shareable by active mysockets */
+    socket_t             socket;
+    bool_t               gro;           /* datagrams may be GRO trains */
+    int                  exit_pipe[2];  /* used to wake up read thread */
+    pthread_t            recv_thread;
+
+    /* the mysocket accepting connections on this port, if any */
+    pthread_mutex_t      listen_lock;
+    mysock_context_t    *listen_ctx;
+} udp_endpoint_t;
+
+/* endpoint_lock protects the endpoint list and reference counts */
+static pthread_mutex_t endpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static udp_endpoint_t *endpoints;
+
+#ifdef UDP_OFFLOAD
+/* set if the kernel (or the route) turns out not to support GSO */
+static bool_t gso_unsupported;
+#endif
+
+
+static udp_endpoint_t *_udp_endpoint_create(const struct sockaddr *addr,
+                                            int addrlen, bool_t shared);
+static void _udp_endpoint_release(udp_endpoint_t *ep);
+static void *_udp_recv_thread_func(void *arg_ptr);
+static int _udp_sendmsg(network_context_t *ctx,
+                        const struct iovec *iov, int iovcnt, size_t gso_size);
+static int _udp_gso_run(const struct iovec *iov, const int *iovcnts,
+                        int count, size_t *seg_len, int *run_iovcnt);
+static void _udp_dispatch(udp_endpoint_t *ep, const struct sockaddr *from,
+                          mysock_buf_t *buf, size_t len, size_t seg_len);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+
+    /* the socket comes from an endpoint, when the mysocket is bound */
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   0,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->sock_ctx   = sock_ctx;
+    udp_io_ctx->endpoint   = NULL;
+    udp_io_ctx->registered = FALSE;
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+    assert(!udp_io_ctx->registered);
+
+    if (udp_io_ctx->endpoint)
+    {
+        _udp_endpoint_release(udp_io_ctx->endpoint);
+        udp_io_ctx->endpoint = NULL;
+    }
+
+    /* the socket belongs to the endpoint */
+    udp_io_ctx->base.socket = -1;
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context,
+ * sharing the endpoint for that port if there is one.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    udp_endpoint_t *ep;
+    uint16_t port;
+
+    assert(ctx && addr);
+    assert(addr->sa_family == AF_INET);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx && !udp_io_ctx->endpoint);
+
+    port = ((struct sockaddr_in *) addr)->sin_port;
+
+    PTHREAD_CALL(pthread_mutex_lock(&endpoint_lock));
+    for (ep = endpoints; ep; ep = ep->next)
+    {
+        if (port != 0 && ep->port == port)
+            break;
+
+        /* an active mysocket can use any ephemeral port from which it
+         * isn't already connected to the same peer.
+         */
+        if (port == 0 && ctx->peer_addr_valid && ep->shared &&
+            _mysock_register_connection(udp_io_ctx->sock_ctx, ep->port))
+        {
+            udp_io_ctx->registered = TRUE;
+            break;
+        }
+    }
+
+    if (!ep)
+    {
+        if (!(ep = _udp_endpoint_create(addr, addrlen,
+                                        port == 0 && ctx->peer_addr_valid)))
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&endpoint_lock));
+            return -1;
+        }
+
+        ep->next  = endpoints;
+        endpoints = ep;
+
+        /* claim the connection now, so another mysocket connecting to the
+         * same peer doesn't choose this endpoint as well.
+         */
+        if (port == 0 && ctx->peer_addr_valid)
+        {
+            udp_io_ctx->registered =
+                _mysock_register_connection(udp_io_ctx->sock_ctx, ep->port);
+            assert(udp_io_ctx->registered);
+        }
+    }
+
+    ++ep->refcnt;
+    PTHREAD_CALL(pthread_mutex_unlock(&endpoint_lock));
+
+    udp_io_ctx->endpoint    = ep;
+    udp_io_ctx->base.socket = ep->socket;
+    return 0;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    udp_endpoint_t *ep;
+    int rc = 0;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    ep = udp_io_ctx->endpoint;
+    assert(ep);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->listen_lock));
+    if (ep->listen_ctx && ep->listen_ctx != udp_io_ctx->sock_ctx)
+    {
+        errno = EADDRINUSE;
+        rc = -1;
+    }
+    else
+    {
+        ep->listen_ctx = udp_io_ctx->sock_ctx;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->listen_lock));
+
+    return rc;
+}
+
+/* the new context shares the listening context's endpoint (passed as
+ * user_data), and receives the peer's packets from now on.
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_udp_t *new_udp_ctx;
+    udp_endpoint_t *ep = (udp_endpoint_t *) user_data;
+
+    assert(new_ctx && accept_ctx && syn_packet && ep);
+
+    new_udp_ctx = (network_context_socket_udp_t *) new_ctx->impl_data;
+    assert(new_udp_ctx && new_udp_ctx->sock_ctx && !new_udp_ctx->endpoint);
+    assert(!new_udp_ctx->sock_ctx->listening);
+    assert(!new_udp_ctx->sock_ctx->is_active);
+
+    PTHREAD_CALL(pthread_mutex_lock(&endpoint_lock));
+    assert(ep->refcnt > 0);
+    ++ep->refcnt;
+    PTHREAD_CALL(pthread_mutex_unlock(&endpoint_lock));
+
+    new_udp_ctx->endpoint    = ep;
+    new_udp_ctx->base.socket = ep->socket;
+
+    /* the SYN wasn't dispatched to an existing connection, so this can't
+     * fail.
+     */
+    new_udp_ctx->registered =
+        _mysock_register_connection(new_udp_ctx->sock_ctx, ep->port);
+    assert(new_udp_ctx->registered);
+}
+
+/* the endpoint's receive thread is already running; this just makes sure
+ * that the connection will be dispatched its packets.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->network_state.impl_data;
+    assert(udp_io_ctx && udp_io_ctx->endpoint);
+
+    if (ctx->listening || udp_io_ctx->registered)
+        return 0;
+
+    if (!_mysock_register_connection(ctx, udp_io_ctx->endpoint->port))
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    udp_io_ctx->registered = TRUE;
+    return 0;
+}
+
+/* stop dispatching packets to the given mysocket.  the endpoint itself is
+ * kept until the mysocket is closed, as the network emulator may still
+ * have packets to send.
+ */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    udp_endpoint_t *ep;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->network_state.impl_data;
+    assert(udp_io_ctx);
+
+    if (!(ep = udp_io_ctx->endpoint))
+        return;
+
+    if (udp_io_ctx->registered)
+    {
+        _mysock_unregister_connection(ctx, ep->port);
+        udp_io_ctx->registered = FALSE;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->listen_lock));
+    if (ep->listen_ctx == ctx)
+        ep->listen_ctx = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->listen_lock));
+}
+
+
+/* send the given packet to the peer, as a single datagram */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, &iovcnt, 1);
+}
+
+/* send count packets to the peer, one datagram each; the i'th packet is
+ * gathered from the next iovcnts[i] entries of iov.  where possible, runs
+ * of packets are handed to the kernel together, to be segmented by GSO.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, const int *iovcnts,
+                              int count)
+{
+    size_t total = 0;
+
+    assert(ctx && iov && iovcnts && count > 0);
+    assert(ctx->peer_addr_len > 0);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    while (count > 0)
+    {
+        size_t seg_len = 0;
+        int k, n = 1, run_iovcnt = iovcnts[0], rc;
+
+#ifdef UDP_OFFLOAD
+        if (!__atomic_load_n(&gso_unsupported, __ATOMIC_RELAXED))
+            n = _udp_gso_run(iov, iovcnts, count, &seg_len, &run_iovcnt);
+#endif
+
+        if ((rc = _udp_sendmsg(ctx, iov, run_iovcnt,
+                               (n > 1) ? seg_len : 0)) < 0)
+            return -1;
+
+#ifdef UDP_OFFLOAD
+        if (rc > 0)
+        {
+            /* GSO was refused; send the packets one at a time from now on */
+            __atomic_store_n(&gso_unsupported, TRUE, __ATOMIC_RELAXED);
+            continue;
+        }
+#endif
+
+        for (k = 0; k < run_iovcnt; ++k)
+            total += iov[k].iov_len;
+        iov     += run_iovcnt;
+        iovcnts += n;
+        count   -= n;
+    }
+
+    return total;
+}
+
+
+/* send a datagram gathered from iovcnt buffers, to be split by the kernel
+ * into gso_size segments if gso_size is non-zero.  returns 0 on success
+ * (or if the datagram was simply lost), 1 if GSO isn't available, or -1
+ * on error.
+ */
+static int _udp_sendmsg(network_context_t *ctx,
+                        const struct iovec *iov, int iovcnt, size_t gso_size)
+{
+    struct msghdr msg;
+#ifdef UDP_OFFLOAD
+    union
+    {
+        char           buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+#endif
+
+    assert(ctx && iov && iovcnt > 0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = &ctx->peer_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = (struct iovec *) iov;
+    msg.msg_iovlen  = iovcnt;
+
+#ifdef UDP_OFFLOAD
+    if (gso_size > 0)
+    {
+        struct cmsghdr *cmsg;
+        uint16_t segment = (uint16_t) gso_size;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type  = UDP_SEGMENT;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+#else
+    assert(gso_size == 0);
+#endif
+
+    while (sendmsg(GET_SOCKET(ctx), &msg, 0) < 0)
+    {
+        /* a full socket buffer, or an ICMP error from an earlier
+         * datagram, just means this one's lost.
+         */
+        if (errno == ENOBUFS || errno == EAGAIN ||
+            errno == ECONNREFUSED || errno == EHOSTUNREACH)
+            break;
+
+        if (gso_size > 0 && (errno == EIO || errno == EINVAL ||
+                             errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+            return 1;
+
+        if (errno != EINTR)
+        {
+            DEBUG_LOG(("sendmsg failed (errno=%d)\n", errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* find the longest run of packets, starting with the first of count, that
+ * can be sent as one GSO datagram:  all the same length (seg_len), except
+ * that the last may be shorter.  returns the number of packets in the run,
+ * and sets run_iovcnt to the number of buffers they're gathered from.
+ */
+static int _udp_gso_run(const struct iovec *iov, const int *iovcnts,
+                        int count, size_t *seg_len, int *run_iovcnt)
+{
+    size_t total = 0;
+    int n, iovcnt = 0;
+
+    assert(iov && iovcnts && count > 0 && seg_len && run_iovcnt);
+
+    for (n = 0; n < count && n < UDP_GSO_MAX_SEGS; ++n)
+    {
+        size_t len = 0;
+        int j;
+
+        assert(iovcnts[n] > 0);
+        for (j = 0; j < iovcnts[n]; ++j)
+            len += iov[j].iov_len;
+        assert(len <= MAX_IP_PAYLOAD_LEN);
+
+        if (n == 0)
+            *seg_len = len;
+        else if (len > *seg_len || total + len > UDP_MAX_PAYLOAD ||
+                 iovcnt + iovcnts[n] > IOV_MAX)
+            break;
+
+        total  += len;
+        iovcnt += iovcnts[n];
+        iov    += iovcnts[n];
+
+        /* a short packet ends the run (as does an empty first one) */
+        if (len < *seg_len || len == 0)
+        {
+            ++n;
+            break;
+        }
+    }
+
+    *run_iovcnt = iovcnt;
+    return n;
+}
+
+
+/* create a socket bound to the given address, and start its receive
+ * thread.  if shared is TRUE, it's an ephemeral port that other active
+ * mysockets may use too.  assumes endpoint_lock is held.  returns NULL on
+ * error.
+ */
+static udp_endpoint_t *_udp_endpoint_create(const struct sockaddr *addr,
+                                            int addrlen, bool_t shared)
+{
+    udp_endpoint_t *ep;
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+
+    assert(addr);
+
+    ep = (udp_endpoint_t *) calloc(1, sizeof(udp_endpoint_t));
+    assert(ep);
+    ep->exit_pipe[0] = ep->exit_pipe[1] = -1;
+
+    if ((ep->socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(ep->socket, addr, addrlen) < 0 ||
+        getsockname(ep->socket, (struct sockaddr *) &sin, &sin_len) < 0 ||
+        pipe(ep->exit_pipe) < 0)
+    {
+        int err = errno;
+
+        if (ep->socket >= 0)
+            closesocket(ep->socket);
+        if (ep->exit_pipe[0] >= 0)
+        {
+            close(ep->exit_pipe[0]);
+            close(ep->exit_pipe[1]);
+        }
+        free(ep);
+        errno = err;
+        return NULL;
+    }
+
+    ep->port      = sin.sin_port;
+    ep->shared    = shared;
+#ifdef UDP_OFFLOAD
+    {
+        int on = 1;
+        ep->gro = (setsockopt(ep->socket, SOL_UDP, UDP_GRO,
+                              &on, sizeof(on)) == 0);
+    }
+#endif
+    PTHREAD_CALL(pthread_mutex_init(&ep->listen_lock, NULL));
+
+    DEBUG_LOG(("created UDP endpoint for port %hu (socket %d)\n",
+               ntohs(ep->port), (int) ep->socket));
+
+    ep->recv_thread = _mysock_create_thread(_udp_recv_thread_func, ep, FALSE);
+    return ep;
+}
+
+/* drop a reference to the given endpoint, closing it once the last
+ * mysocket using it has gone.
+ */
+static void _udp_endpoint_release(udp_endpoint_t *ep)
+{
+    udp_endpoint_t **prev;
+    char dummy = 'X';
+
+    assert(ep);
+
+    PTHREAD_CALL(pthread_mutex_lock(&endpoint_lock));
+    assert(ep->refcnt > 0);
+    if (--ep->refcnt > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&endpoint_lock));
+        return;
+    }
+
+    for (prev = &endpoints; *prev != ep; prev = &(*prev)->next)
+        assert(*prev);
+    *prev = ep->next;
+    PTHREAD_CALL(pthread_mutex_unlock(&endpoint_lock));
+
+    assert(!ep->listen_ctx);
+    if (write(ep->exit_pipe[EXIT_PIPE_WRITE_INDEX],
+              &dummy, sizeof(dummy)) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    PTHREAD_CALL(pthread_join(ep->recv_thread, NULL));
+
+    DEBUG_LOG(("closing UDP endpoint for port %hu\n", ntohs(ep->port)));
+    closesocket(ep->socket);
+    close(ep->exit_pipe[0]);
+    close(ep->exit_pipe[1]);
+    PTHREAD_CALL(pthread_mutex_destroy(&ep->listen_lock));
+    free(ep);
+}
+
+/* receive datagrams on an endpoint, and pass each to the connection it
+ * belongs to, or to the listening mysocket.
+ */
+static void *_udp_recv_thread_func(void *arg_ptr)
+{
+    udp_endpoint_t *ep = (udp_endpoint_t *) arg_ptr;
+    mysock_buf_t *packet_buf = NULL;
+    size_t buf_size;
+
+    assert(ep);
+    DEBUG_LOG(("started UDP receive thread\n"));
+
+    buf_size = ep->gro ? UDP_MAX_PAYLOAD : MYSOCK_BUF_SIZE;
+
+    for (;;)
+    {
+        struct pollfd fds[2];
+        struct sockaddr_in from;
+        struct msghdr msg;
+        struct iovec iov;
+        size_t seg_len;
+        ssize_t bytes_read;
+#ifdef UDP_OFFLOAD
+        union
+        {
+            char           buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct cmsghdr *cmsg;
+#endif
+
+        fds[0].fd     = ep->exit_pipe[EXIT_PIPE_READ_INDEX];
+        fds[0].events = POLLIN;
+        fds[1].fd     = ep->socket;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents)
+            continue;
+
+        if (!packet_buf)
+            packet_buf = _mysock_buf_alloc(buf_size);
+
+        iov.iov_base = packet_buf->data;
+        iov.iov_len  = buf_size;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name    = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov     = &iov;
+        msg.msg_iovlen  = 1;
+#ifdef UDP_OFFLOAD
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+#endif
+
+        if ((bytes_read = recvmsg(ep->socket, &msg, 0)) <= 0 ||
+            from.sin_family != AF_INET)
+        {
+            /* e.g. an ICMP error for an earlier datagram */
+            DEBUG_LOG(("recvmsg failed (rc=%d, errno=%d)\n",
+                       (int) bytes_read, errno));
+            continue;
+        }
+
+        /* a GRO train is a run of seg_len byte segments */
+        seg_len = bytes_read;
+#ifdef UDP_OFFLOAD
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int gso_size;
+
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                if (gso_size > 0)
+                    seg_len = gso_size;
+            }
+        }
+#endif
+
+        if (buf_size > MYSOCK_BUF_SIZE && bytes_read <= MYSOCK_BUF_SIZE)
+        {
+            /* don't tie up a whole GRO-sized buffer for a lone packet;
+             * the large one is kept for the next datagram.
+             */
+            mysock_buf_t *small_buf = _mysock_buf_alloc(bytes_read);
+
+            memcpy(small_buf->data, packet_buf->data, bytes_read);
+            _udp_dispatch(ep, (struct sockaddr *) &from, small_buf,
+                          bytes_read, seg_len);
+            _mysock_buf_release(small_buf);
+        }
+        else
+        {
+            _udp_dispatch(ep, (struct sockaddr *) &from, packet_buf,
+                          bytes_read, seg_len);
+            _mysock_buf_release(packet_buf);
+            packet_buf = NULL;
+        }
+    }
+
+    _mysock_buf_release(packet_buf);
+    return NULL;
+}
+
+/* pass each seg_len byte segment of the len bytes received in buf to the
+ * connection it belongs to, or to the listening mysocket.  each queued
+ * segment holds its own reference to buf.
+ */
+static void _udp_dispatch(udp_endpoint_t *ep, const struct sockaddr *from,
+                          mysock_buf_t *buf, size_t len, size_t seg_len)
+{
+    size_t offset;
+
+    assert(ep && from && buf && seg_len > 0);
+
+    for (offset = 0; offset < len; offset += seg_len)
+    {
+        size_t packet_len = MIN(seg_len, len - offset);
+        mysock_buf_t *ref = buf;
+
+        _mysock_buf_ref(ref);
+        if (_mysock_dispatch_packet(ep->port, from, &ref,
+                                    buf->data + offset, packet_len))
+            continue;
+        _mysock_buf_release(ref);
+
+        /* not part of an established connection */
+        PTHREAD_CALL(pthread_mutex_lock(&ep->listen_lock));
+        if (ep->listen_ctx)
+        {
+            (void) _mysock_enqueue_connection(ep->listen_ctx,
+                                              buf->data + offset, packet_len,
+                                              from, sizeof(struct sockaddr_in),
+                                              ep);
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->listen_lock));
+    }
+}
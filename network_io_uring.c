@@ -0,0 +1,1266 @@
+/* network_io_uring.c: io_uring instantiation of the underlying unreliable
+ * datagram service.  like network_io_tcp.c, packets are carried over TCP,
+ * each preceded by a two-byte length; but rather than a receive thread
+ * (and blocking system calls) per mysocket, all of the process's socket
+ * I/O goes through a single io_uring, driven by a single completion
+ * thread.  this is Linux-only.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+/* a few words about the io_uring network layer...
+ *
+ *   - receives use multishot recv:  one SQE per connection stays armed,
+ *     and the kernel picks a buffer for each chunk of the stream from a
+ *     ring of provided buffers, so no buffer is tied up by an idle
+ *     connection.  the completion thread parses frames out of each chunk
+ *     (reassembling any that straddle chunks) and queues them for the
+ *     transport layer, then hands the buffer straight back to the kernel.
+ *   - each connection has two halves of a registered (fixed) buffer for
+ *     sending.  senders copy framed packets into one half while the other
+ *     is being written, so there's at most one write in flight per
+ *     connection (keeping the stream in order), and packets queued in the
+ *     meantime go out together in the next write.
+ *   - a write of at least URING_ZC_MIN bytes is sent zero-copy (the
+ *     io_uring form of MSG_ZEROCOPY):  the kernel transmits straight from
+ *     the registered buffer, and posts a notification once it's done with
+ *     it, so the half isn't refilled until then.  if a notification says
+ *     the kernel had to copy the data after all (e.g. over loopback), the
+ *     connection goes back to ordinary writes.
+ *   - listening sockets have an accept SQE armed.  an accepted stream
+ *     belongs to no mysocket until its SYN arrives, when it's dispatched
+ *     through the connection demultiplexer as in the TCP case, and the
+ *     new mysocket takes over the stream.
+ * the completion thread reaps completions in batches, and the SQEs they
+ * generate (re-arming receives, continuing writes) are submitted together
+ * afterwards.
+ */
+
+
+#define URING_ENTRIES       256
+
+/* provided receive buffers (a power of two of them) */
+#define URING_BUF_GROUP     0
+#define URING_RX_BUFS       64
+#define URING_RX_BUF_SIZE   (16 * 1024)
+
+/* each half of a connection's registered send buffer */
+#define URING_TX_HALF       (32 * 1024)
+
+/* smallest write sent zero-copy.  below this, pinning the pages and
+ * handling the extra notification cost more than the copy saved.
+ */
+#define URING_ZC_MIN        (16 * 1024)
+
+#define URING_FRAME_MAX     (sizeof(uint16_t) + 65535)
+
+enum { URING_OP_RECV = 1, URING_OP_SEND, URING_OP_ACCEPT };
+
+/* the user_data of each SQE points at one of these */
+typedef struct
+{
+    int   kind;     /* URING_OP_* */
+    void *owner;    /* uring_conn_t or uring_listener_t */
+} uring_op_t;
+
+typedef struct uring_conn
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;         /* send space, or teardown progress */
+
+    socket_t          fd;
+    struct sockaddr   peer_addr;
+    socklen_t         peer_addr_len;
+
+    /* the mysocket the stream's packets are queued for, if any.  until
+     * its SYN arrives, an accepted stream just has the listener it came in
+     * on.  an orphan has neither, and is freed by the completion thread
+     * (closing its socket) once its I/O is finished.
+     */
+    mysock_context_t      *sock_ctx;
+    struct uring_listener *listener;
+    bool_t                 orphan;
+    bool_t                 closing;
+    bool_t                 failed;      /* a write failed */
+
+    uring_op_t        rx_op;
+    bool_t            rx_armed;
+    char             *rx_partial;       /* a frame straddling chunks */
+    size_t            rx_partial_len;
+
+    uring_op_t        tx_op;
+    int               tx_slot;          /* registered buffer pair, or -1 */
+    char             *tx_buf[2];
+    size_t            tx_len[2];
+    int               tx_fill;          /* half being filled */
+    bool_t            tx_busy;          /* the other half is being written */
+    size_t            tx_sent;
+    bool_t            tx_sending;       /* a write SQE is in flight */
+    bool_t            tx_zc;            /* which is a zero-copy send */
+    bool_t            tx_zc_copied;     /* zero-copy didn't avoid a copy */
+    int               tx_notifs;        /* zero-copy notifications due */
+} uring_conn_t;
+
+typedef struct uring_listener
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    int               refcnt;   /* the mysocket, and streams awaiting SYNs */
+
+    socket_t          fd;
+    mysock_context_t *sock_ctx; /* NULL once the mysocket stops listening */
+    uring_op_t        accept_op;
+    bool_t            armed;
+} uring_listener_t;
+
+/* the ring.  sq_lock serialises submissions; only the completion thread
+ * touches the completion queue and the provided buffer ring.
+ */
+static pthread_once_t   uring_once = PTHREAD_ONCE_INIT;
+static int              uring_init_rc = -1;
+static int              uring_fd = -1;
+
+static pthread_mutex_t  sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int     sq_entries, sq_local_tail, sq_submitted;
+static struct io_uring_sqe *sqes;
+
+static unsigned int    *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_buf_ring *rx_ring;
+static char            *rx_bufs;
+
+/* registered send buffers, two per slot */
+static pthread_mutex_t  tx_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static char            *tx_arena;
+static bool_t           tx_slot_used[MAX_NUM_CONNECTIONS];
+static bool_t           zc_unsupported; /* the kernel refused SEND_ZC */
+
+
+static void _uring_init(void);
+static void *_uring_completion_thread_func(void *arg_ptr);
+static struct io_uring_sqe *_uring_get_sqe(void);
+static void _uring_submit(void);
+static void _uring_prep_recv(uring_conn_t *conn);
+static void _uring_prep_accept(uring_listener_t *listener);
+static void _uring_prep_write(uring_conn_t *conn);
+static void _uring_prep_cancel(uring_op_t *op);
+static void _uring_recycle_buffer(unsigned int bid);
+static int _uring_connect(network_context_t *ctx);
+static uring_conn_t *_uring_conn_create(socket_t fd);
+static int _uring_conn_attach(uring_conn_t *conn, mysock_context_t *sock_ctx);
+static void _uring_conn_close(uring_conn_t *conn);
+static void _uring_conn_orphan(uring_conn_t *conn);
+static bool_t _uring_conn_finished(uring_conn_t *conn);
+static void _uring_conn_free(uring_conn_t *conn);
+static void _uring_tx_kick(uring_conn_t *conn, bool_t submit);
+static void _uring_handle_recv(uring_conn_t *conn,
+                               const struct io_uring_cqe *cqe);
+static void _uring_handle_send(uring_conn_t *conn,
+                               const struct io_uring_cqe *cqe);
+static void _uring_handle_accept(uring_listener_t *listener,
+                                 const struct io_uring_cqe *cqe);
+static void _uring_parse(uring_conn_t *conn, const char *data, size_t len);
+static void _uring_deliver(uring_conn_t *conn,
+                           const char *packet, size_t packet_len);
+static void _uring_listener_release(uring_listener_t *listener);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+
+    PTHREAD_CALL(pthread_once(&uring_once, _uring_init));
+    if (uring_init_rc < 0)
+        return -1;
+
+    /* the socket, but not the exit pipe, is needed */
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   0,
+                                   sizeof(network_context_socket_uring_t))) < 0)
+        return rc;
+
+    uring_io_ctx = (network_context_socket_uring_t *) net_ctx->impl_data;
+    assert(uring_io_ctx);
+
+    if ((uring_io_ctx->base.socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket");
+        _network_close_socket(net_ctx);
+        return -1;
+    }
+
+    uring_io_ctx->sock_ctx  = sock_ctx;
+    uring_io_ctx->connected = FALSE;
+    uring_io_ctx->conn      = NULL;
+    uring_io_ctx->listener  = NULL;
+
+    PTHREAD_CALL(pthread_mutex_init(&uring_io_ctx->connect_lock, NULL));
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+
+    assert(ctx);
+
+    uring_io_ctx = (network_context_socket_uring_t *) ctx->impl_data;
+    assert(uring_io_ctx);
+
+    _network_stop_recv_thread(uring_io_ctx->sock_ctx);
+
+    /* the stream's socket is closed below, with the mysocket's */
+    if (uring_io_ctx->conn)
+    {
+        _uring_conn_close(uring_io_ctx->conn);
+        uring_io_ctx->conn = NULL;
+    }
+
+    PTHREAD_CALL(pthread_mutex_destroy(&uring_io_ctx->connect_lock));
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return listen(GET_SOCKET(ctx), backlog);
+}
+
+/* the new context takes over the stream (passed as user_data) that the SYN
+ * arrived on.  this is called by the completion thread, with the stream's
+ * lock held.
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_uring_t *new_uring_ctx;
+    uring_conn_t *conn = (uring_conn_t *) user_data;
+
+    assert(new_ctx && accept_ctx && syn_packet && conn);
+
+    new_uring_ctx = (network_context_socket_uring_t *) new_ctx->impl_data;
+    assert(new_uring_ctx && new_uring_ctx->sock_ctx);
+    assert(!new_uring_ctx->sock_ctx->listening);
+    assert(!new_uring_ctx->sock_ctx->is_active);
+    assert(!new_uring_ctx->conn);
+
+    closesocket(new_uring_ctx->base.socket);
+    new_uring_ctx->base.socket = conn->fd;
+    new_uring_ctx->connected   = TRUE;
+    new_uring_ctx->conn        = conn;
+
+    if (_uring_conn_attach(conn, new_uring_ctx->sock_ctx) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    DEBUG_LOG(("passed accepted socket %d on to new context...\n",
+               (int) conn->fd));
+}
+
+/* there's no receive thread per mysocket; a listening mysocket just needs
+ * its accept()s to be started.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+    uring_listener_t *listener;
+
+    assert(ctx);
+
+    uring_io_ctx =
+        (network_context_socket_uring_t *) ctx->network_state.impl_data;
+    assert(uring_io_ctx);
+
+    if (!ctx->listening)
+        return 0;
+
+    assert(!uring_io_ctx->listener);
+    listener = (uring_listener_t *) calloc(1, sizeof(uring_listener_t));
+    assert(listener);
+
+    PTHREAD_CALL(pthread_mutex_init(&listener->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&listener->cond, NULL));
+    listener->refcnt          = 1;
+    listener->fd              = uring_io_ctx->base.socket;
+    listener->sock_ctx        = ctx;
+    listener->accept_op.kind  = URING_OP_ACCEPT;
+    listener->accept_op.owner = listener;
+    uring_io_ctx->listener    = listener;
+
+    PTHREAD_CALL(pthread_mutex_lock(&listener->lock));
+    listener->armed = TRUE;
+    PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+    _uring_prep_accept(listener);
+    _uring_submit();
+    PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&listener->lock));
+
+    return 0;
+}
+
+/* stop queueing incoming packets (or connections) for the mysocket.  once
+ * this returns, the completion thread no longer refers to it.
+ */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+    uring_listener_t *listener;
+
+    assert(ctx);
+
+    uring_io_ctx =
+        (network_context_socket_uring_t *) ctx->network_state.impl_data;
+    assert(uring_io_ctx);
+
+    if (uring_io_ctx->conn)
+    {
+        uring_conn_t *conn = uring_io_ctx->conn;
+
+        PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+        conn->sock_ctx = NULL;
+        PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+    }
+
+    if ((listener = uring_io_ctx->listener) != NULL)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&listener->lock));
+        listener->sock_ctx = NULL;
+        if (listener->armed)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+            _uring_prep_cancel(&listener->accept_op);
+            _uring_submit();
+            PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+        }
+        while (listener->armed)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&listener->cond,
+                                           &listener->lock));
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&listener->lock));
+
+        uring_io_ctx->listener = NULL;
+        _uring_listener_release(listener);
+    }
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, &iovcnt, 1);
+}
+
+/* queue count packets for the peer, each framed with its length; the i'th
+ * packet is gathered from the next iovcnts[i] entries of iov.  they're
+ * written as soon as the connection's previous write has completed.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, const int *iovcnts,
+                              int count)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+    uring_conn_t *conn;
+    size_t total = 0;
+    int k, j;
+
+    assert(ctx && iov && iovcnts && count > 0);
+    assert(ctx->peer_addr_len > 0);
+
+    uring_io_ctx = (network_context_socket_uring_t *) ctx->impl_data;
+    assert(uring_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (_uring_connect(ctx) < 0)
+        return -1;
+
+    conn = uring_io_ctx->conn;
+    assert(conn);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    for (k = 0; k < count; ++k)
+    {
+        uint16_t packet_len;
+        size_t len = 0;
+        char *p;
+
+        assert(iovcnts[k] > 0);
+        for (j = 0; j < iovcnts[k]; ++j)
+            len += iov[j].iov_len;
+        assert(len <= MAX_IP_PAYLOAD_LEN);
+
+        /* wait for room in the half being filled */
+        while (!conn->failed &&
+               URING_TX_HALF - conn->tx_len[conn->tx_fill] <
+               sizeof(packet_len) + len)
+        {
+            if (!conn->tx_busy)
+                _uring_tx_kick(conn, TRUE);
+            else
+                PTHREAD_CALL(pthread_cond_wait(&conn->cond, &conn->lock));
+        }
+
+        if (conn->failed)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+            errno = EPIPE;
+            return -1;
+        }
+
+        p = conn->tx_buf[conn->tx_fill] + conn->tx_len[conn->tx_fill];
+        packet_len = htons(len);
+        memcpy(p, &packet_len, sizeof(packet_len));
+        p += sizeof(packet_len);
+        for (j = 0; j < iovcnts[k]; ++j)
+        {
+            memcpy(p, iov[j].iov_base, iov[j].iov_len);
+            p += iov[j].iov_len;
+        }
+
+        conn->tx_len[conn->tx_fill] += sizeof(packet_len) + len;
+        iov   += iovcnts[k];
+        total += len;
+    }
+
+    if (!conn->tx_busy)
+        _uring_tx_kick(conn, TRUE);
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    return total;
+}
+
+
+/* set up the ring, its registered send buffers and provided receive
+ * buffers, and start the completion thread.  sets uring_init_rc.
+ */
+static void _uring_init(void)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    struct iovec tx_iov[2 * MAX_NUM_CONNECTIONS];
+    size_t sq_len, cq_len;
+    char *sq_ptr, *cq_ptr;
+    int k;
+
+    memset(&params, 0, sizeof(params));
+    if ((uring_fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES,
+                                  &params)) < 0)
+    {
+        perror("io_uring_setup");
+        return;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_len = params.cq_off.cqes +
+             params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+    sq_ptr = (char *) mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring_fd,
+                           IORING_OFF_SQ_RING);
+    assert(sq_ptr != MAP_FAILED);
+
+    cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_ptr = (char *) mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, uring_fd,
+                               IORING_OFF_CQ_RING);
+        assert(cq_ptr != MAP_FAILED);
+    }
+
+    sqes = (struct io_uring_sqe *)
+        mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd,
+             IORING_OFF_SQES);
+    assert(sqes != MAP_FAILED);
+
+    sq_head    = (unsigned int *) (sq_ptr + params.sq_off.head);
+    sq_tail    = (unsigned int *) (sq_ptr + params.sq_off.tail);
+    sq_mask    = (unsigned int *) (sq_ptr + params.sq_off.ring_mask);
+    sq_array   = (unsigned int *) (sq_ptr + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = sq_submitted = *sq_tail;
+
+    cq_head = (unsigned int *) (cq_ptr + params.cq_off.head);
+    cq_tail = (unsigned int *) (cq_ptr + params.cq_off.tail);
+    cq_mask = (unsigned int *) (cq_ptr + params.cq_off.ring_mask);
+    cqes    = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+
+    /* fixed send buffers */
+    tx_arena = (char *) mmap(NULL, 2 * MAX_NUM_CONNECTIONS * URING_TX_HALF,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(tx_arena != MAP_FAILED);
+    for (k = 0; k < 2 * MAX_NUM_CONNECTIONS; ++k)
+    {
+        tx_iov[k].iov_base = tx_arena + k * URING_TX_HALF;
+        tx_iov[k].iov_len  = URING_TX_HALF;
+    }
+    if (syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_BUFFERS,
+                tx_iov, 2 * MAX_NUM_CONNECTIONS) < 0)
+    {
+        perror("io_uring_register (buffers)");
+        return;
+    }
+
+    /* provided receive buffers */
+    rx_ring = (struct io_uring_buf_ring *)
+        mmap(NULL, URING_RX_BUFS * sizeof(struct io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(rx_ring != MAP_FAILED);
+    rx_bufs = (char *) malloc(URING_RX_BUFS * URING_RX_BUF_SIZE);
+    assert(rx_bufs);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t) rx_ring;
+    reg.ring_entries = URING_RX_BUFS;
+    reg.bgid         = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+    {
+        perror("io_uring_register (provided buffers)");
+        return;
+    }
+
+    for (k = 0; k < URING_RX_BUFS; ++k)
+        _uring_recycle_buffer(k);
+
+    (void) _mysock_create_thread(_uring_completion_thread_func, NULL, TRUE);
+    uring_init_rc = 0;
+}
+
+/* reap completions, and act on them.  SQEs queued while handling a batch
+ * of completions are submitted together at the end of it.
+ */
+static void *_uring_completion_thread_func(void *arg_ptr)
+{
+    for (;;)
+    {
+        unsigned int head, tail;
+
+        head = *cq_head;
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (syscall(__NR_io_uring_enter, uring_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            {
+                assert(errno == EINTR);
+            }
+            continue;
+        }
+
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe cqe = cqes[head & *cq_mask];
+            uring_op_t *op = (uring_op_t *) (uintptr_t) cqe.user_data;
+
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            if (!op)
+                continue;   /* a cancellation */
+
+            switch (op->kind)
+            {
+            case URING_OP_RECV:
+                _uring_handle_recv((uring_conn_t *) op->owner, &cqe);
+                break;
+            case URING_OP_SEND:
+                _uring_handle_send((uring_conn_t *) op->owner, &cqe);
+                break;
+            case URING_OP_ACCEPT:
+                _uring_handle_accept((uring_listener_t *) op->owner, &cqe);
+                break;
+            default:
+                assert(0);
+                break;
+            }
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+        _uring_submit();
+        PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+    }
+
+    return NULL;
+}
+
+/* return a zeroed SQE, submitting those already queued if the ring is
+ * full.  assumes sq_lock is held.
+ */
+static struct io_uring_sqe *_uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+           sq_entries)
+    {
+        _uring_submit();
+    }
+
+    index = sq_local_tail & *sq_mask;
+    sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++sq_local_tail;
+    return sqe;
+}
+
+/* submit the SQEs queued so far.  assumes sq_lock is held. */
+static void _uring_submit(void)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+    while (sq_submitted != sq_local_tail)
+    {
+        int rc = (int) syscall(__NR_io_uring_enter, uring_fd,
+                               sq_local_tail - sq_submitted, 0, 0, NULL, 0);
+        if (rc < 0)
+        {
+            assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+            continue;
+        }
+        sq_submitted += rc;
+    }
+}
+
+/* arm a multishot receive on the stream.  assumes sq_lock is held. */
+static void _uring_prep_recv(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe();
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = (uintptr_t) &conn->rx_op;
+}
+
+/* assumes sq_lock is held */
+static void _uring_prep_accept(uring_listener_t *listener)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe();
+
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = listener->fd;
+    sqe->user_data = (uintptr_t) &listener->accept_op;
+}
+
+/* write the rest of the half of the send buffer that's in flight, without
+ * copying it if it's large enough.  assumes conn's lock and sq_lock are
+ * held.
+ */
+static void _uring_prep_write(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe();
+    int half = conn->tx_fill ^ 1;
+
+    assert(conn->tx_sent < conn->tx_len[half]);
+    assert(!conn->tx_sending);
+
+    conn->tx_zc = !conn->tx_zc_copied &&
+                  !__atomic_load_n(&zc_unsupported, __ATOMIC_RELAXED) &&
+                  conn->tx_len[half] - conn->tx_sent >= URING_ZC_MIN;
+    conn->tx_sending = TRUE;
+
+    if (conn->tx_zc)
+    {
+        sqe->opcode    = IORING_OP_SEND_ZC;
+        sqe->ioprio    = IORING_RECVSEND_FIXED_BUF |
+                         IORING_SEND_ZC_REPORT_USAGE;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    else
+    {
+        sqe->opcode    = IORING_OP_WRITE_FIXED;
+    }
+    sqe->fd        = conn->fd;
+    sqe->addr      = (uintptr_t) (conn->tx_buf[half] + conn->tx_sent);
+    sqe->len       = conn->tx_len[half] - conn->tx_sent;
+    sqe->buf_index = 2 * conn->tx_slot + half;
+    sqe->user_data = (uintptr_t) &conn->tx_op;
+}
+
+/* assumes sq_lock is held */
+static void _uring_prep_cancel(uring_op_t *op)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe();
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = (uintptr_t) op;
+    sqe->user_data = 0;
+}
+
+/* hand a provided buffer back to the kernel.  only the completion thread
+ * (or _uring_init()) does this.
+ */
+static void _uring_recycle_buffer(unsigned int bid)
+{
+    unsigned short tail = rx_ring->tail;
+    struct io_uring_buf *buf = &rx_ring->bufs[tail & (URING_RX_BUFS - 1)];
+
+    assert(bid < URING_RX_BUFS);
+    buf->addr = (uintptr_t) (rx_bufs + bid * URING_RX_BUF_SIZE);
+    buf->len  = URING_RX_BUF_SIZE;
+    buf->bid  = bid;
+    __atomic_store_n(&rx_ring->tail, (unsigned short) (tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+/* connect to the peer, if we haven't already, and start receiving.  once
+ * connected, this is just an atomic load, as in network_io_tcp.c.
+ */
+static int _uring_connect(network_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_io_ctx;
+    int rc = 0;
+
+    assert(ctx);
+
+    uring_io_ctx = (network_context_socket_uring_t *) ctx->impl_data;
+    assert(uring_io_ctx);
+
+    if (__atomic_load_n(&uring_io_ctx->connected, __ATOMIC_ACQUIRE))
+        return 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_io_ctx->connect_lock));
+    if (!uring_io_ctx->connected)
+    {
+        uring_conn_t *conn;
+
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+
+        if (connect(GET_SOCKET(ctx), &ctx->peer_addr,
+                    sizeof(ctx->peer_addr)) < 0)
+        {
+            perror("connect (_uring_connect)");
+            rc = -1;
+        }
+        else
+        {
+            conn = _uring_conn_create(GET_SOCKET(ctx));
+
+            PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+            if ((rc = _uring_conn_attach(conn, uring_io_ctx->sock_ctx)) == 0)
+            {
+                conn->rx_armed = TRUE;
+                PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+                _uring_prep_recv(conn);
+                _uring_submit();
+                PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+            }
+            PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+            if (rc < 0)
+            {
+                conn->fd = -1;  /* still the mysocket's */
+                _uring_conn_free(conn);
+            }
+            else
+            {
+                uring_io_ctx->conn = conn;
+                __atomic_store_n(&uring_io_ctx->connected, TRUE,
+                                 __ATOMIC_RELEASE);
+            }
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_io_ctx->connect_lock));
+
+    return rc;
+}
+
+static uring_conn_t *_uring_conn_create(socket_t fd)
+{
+    uring_conn_t *conn = (uring_conn_t *) calloc(1, sizeof(uring_conn_t));
+
+    assert(conn);
+    PTHREAD_CALL(pthread_mutex_init(&conn->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&conn->cond, NULL));
+
+    conn->fd            = fd;
+    conn->peer_addr_len = sizeof(conn->peer_addr);
+    (void) getpeername(fd, &conn->peer_addr, &conn->peer_addr_len);
+
+    conn->rx_op.kind  = URING_OP_RECV;
+    conn->rx_op.owner = conn;
+    conn->rx_partial  = (char *) malloc(URING_FRAME_MAX);
+    assert(conn->rx_partial);
+
+    conn->tx_op.kind  = URING_OP_SEND;
+    conn->tx_op.owner = conn;
+    conn->tx_slot     = -1;
+
+    return conn;
+}
+
+/* give the stream to the given mysocket, with a pair of send buffers.
+ * assumes conn's lock is held (or that it's not yet shared).
+ */
+static int _uring_conn_attach(uring_conn_t *conn, mysock_context_t *sock_ctx)
+{
+    int k;
+
+    assert(conn && sock_ctx && conn->tx_slot < 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&tx_slot_lock));
+    for (k = 0; k < MAX_NUM_CONNECTIONS && tx_slot_used[k]; ++k)
+        ;
+    if (k < MAX_NUM_CONNECTIONS)
+        tx_slot_used[k] = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&tx_slot_lock));
+
+    if (k == MAX_NUM_CONNECTIONS)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    conn->tx_slot   = k;
+    conn->tx_buf[0] = tx_arena + (2 * k) * URING_TX_HALF;
+    conn->tx_buf[1] = tx_arena + (2 * k + 1) * URING_TX_HALF;
+    conn->sock_ctx  = sock_ctx;
+    return 0;
+}
+
+/* wait for the stream's queued packets to be written, and for its I/O to
+ * finish, then free it.  its socket belongs to the mysocket.
+ */
+static void _uring_conn_close(uring_conn_t *conn)
+{
+    assert(conn);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    while (conn->tx_busy)
+        PTHREAD_CALL(pthread_cond_wait(&conn->cond, &conn->lock));
+
+    conn->closing  = TRUE;
+    conn->sock_ctx = NULL;
+    if (conn->rx_armed)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+        _uring_prep_cancel(&conn->rx_op);
+        _uring_submit();
+        PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+    }
+
+    while (!_uring_conn_finished(conn))
+        PTHREAD_CALL(pthread_cond_wait(&conn->cond, &conn->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    conn->fd = -1;
+    _uring_conn_free(conn);
+}
+
+/* abandon a stream that no mysocket has taken over; the completion thread
+ * frees it (and closes its socket) once its receive has been cancelled.
+ * called by the completion thread with conn's lock held.
+ */
+static void _uring_conn_orphan(uring_conn_t *conn)
+{
+    assert(conn && !conn->sock_ctx && !conn->tx_busy);
+
+    conn->orphan  = TRUE;
+    conn->closing = TRUE;
+    if (conn->rx_armed)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+        _uring_prep_cancel(&conn->rx_op);
+        PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+    }
+}
+
+/* TRUE once a closing stream has no I/O outstanding.  assumes conn's lock
+ * is held.
+ */
+static bool_t _uring_conn_finished(uring_conn_t *conn)
+{
+    return conn->closing && !conn->rx_armed && !conn->tx_busy;
+}
+
+static void _uring_conn_free(uring_conn_t *conn)
+{
+    assert(conn);
+
+    if (conn->fd >= 0)
+        closesocket(conn->fd);
+
+    if (conn->tx_slot >= 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&tx_slot_lock));
+        tx_slot_used[conn->tx_slot] = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&tx_slot_lock));
+    }
+
+    if (conn->listener)
+        _uring_listener_release(conn->listener);
+
+    PTHREAD_CALL(pthread_cond_destroy(&conn->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&conn->lock));
+    free(conn->rx_partial);
+    free(conn);
+}
+
+/* start writing the half of the send buffer that's been filled, submitting
+ * the write straight away unless the completion thread will.  assumes
+ * conn's lock is held, and that no write is in flight.
+ */
+static void _uring_tx_kick(uring_conn_t *conn, bool_t submit)
+{
+    assert(conn && !conn->tx_busy);
+
+    if (conn->tx_len[conn->tx_fill] == 0)
+        return;
+
+    conn->tx_fill ^= 1;
+    conn->tx_busy  = TRUE;
+    conn->tx_sent  = 0;
+    assert(conn->tx_len[conn->tx_fill] == 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+    _uring_prep_write(conn);
+    if (submit)
+        _uring_submit();
+    PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+}
+
+static void _uring_handle_recv(uring_conn_t *conn,
+                               const struct io_uring_cqe *cqe)
+{
+    bool_t finished, orphan;
+
+    assert(conn && cqe);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0 && !conn->closing)
+            _uring_parse(conn, rx_bufs + bid * URING_RX_BUF_SIZE, cqe->res);
+        _uring_recycle_buffer(bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        /* the kernel has stopped the receive:  re-arm it if it just ran
+         * out of buffers (or stopped for its own reasons), but not at the
+         * end of the stream, on an error, or once it's been cancelled.
+         */
+        conn->rx_armed = FALSE;
+        if (!conn->closing && (cqe->res > 0 || cqe->res == -ENOBUFS))
+        {
+            conn->rx_armed = TRUE;
+            PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+            _uring_prep_recv(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+        }
+        else if (!conn->closing && conn->listener)
+        {
+            /* an accepted stream that was closed before its SYN arrived */
+            _uring_conn_orphan(conn);
+        }
+    }
+
+    /* once it's finished, the mysocket closing a stream may free it as
+     * soon as we let go of it
+     */
+    orphan   = conn->orphan;
+    finished = _uring_conn_finished(conn);
+    if (finished && !orphan)
+        PTHREAD_CALL(pthread_cond_broadcast(&conn->cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    if (finished && orphan)
+        _uring_conn_free(conn);
+}
+
+static void _uring_handle_send(uring_conn_t *conn,
+                               const struct io_uring_cqe *cqe)
+{
+    int half;
+
+    assert(conn && cqe);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    assert(conn->tx_busy);
+    half = conn->tx_fill ^ 1;
+
+    if (cqe->flags & IORING_CQE_F_NOTIF)
+    {
+        /* the kernel's finished with the buffer behind a zero-copy send */
+        assert(conn->tx_notifs > 0);
+        --conn->tx_notifs;
+        if ((uint32_t) cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+            conn->tx_zc_copied = TRUE;
+    }
+    else
+    {
+        assert(conn->tx_sending);
+        conn->tx_sending = FALSE;
+        if (cqe->flags & IORING_CQE_F_MORE)
+            ++conn->tx_notifs;  /* it'll be followed by a notification */
+
+        if (conn->tx_zc && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP))
+        {
+            /* no zero-copy sends on this kernel (or socket); retry the
+             * write the ordinary way
+             */
+            __atomic_store_n(&zc_unsupported, TRUE, __ATOMIC_RELAXED);
+            PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+            _uring_prep_write(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+        }
+        else if (cqe->res <= 0)
+        {
+            DEBUG_LOG(("io_uring write failed (res=%d)\n", cqe->res));
+            conn->failed  = TRUE;
+            conn->tx_sent = conn->tx_len[half];
+        }
+        else if ((conn->tx_sent += cqe->res) < conn->tx_len[half])
+        {
+            /* a short write; carry on from where it stopped */
+            PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+            _uring_prep_write(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+        }
+    }
+
+    /* the half can be refilled once it's all been written, and the kernel
+     * has let go of it
+     */
+    if (!conn->tx_sending && conn->tx_notifs == 0)
+    {
+        assert(conn->tx_sent == conn->tx_len[half]);
+        conn->tx_len[half] = 0;
+        conn->tx_busy      = FALSE;
+        if (!conn->failed)
+            _uring_tx_kick(conn, FALSE);    /* anything queued meanwhile */
+    }
+
+    PTHREAD_CALL(pthread_cond_broadcast(&conn->cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+}
+
+static void _uring_handle_accept(uring_listener_t *listener,
+                                 const struct io_uring_cqe *cqe)
+{
+    assert(listener && cqe);
+
+    PTHREAD_CALL(pthread_mutex_lock(&listener->lock));
+    listener->armed = FALSE;
+
+    if (cqe->res >= 0)
+    {
+        if (listener->sock_ctx)
+        {
+            /* the stream waits for its SYN before joining a mysocket */
+            uring_conn_t *conn = _uring_conn_create(cqe->res);
+
+            DEBUG_LOG(("accepted from peer, fd=%d...\n", cqe->res));
+            conn->listener = listener;
+            ++listener->refcnt;
+
+            conn->rx_armed = TRUE;
+            PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+            _uring_prep_recv(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+        }
+        else
+        {
+            closesocket(cqe->res);
+        }
+    }
+    else if (cqe->res != -ECANCELED)
+    {
+        errno = -cqe->res;
+        perror("accept (network_io_uring)");
+    }
+
+    if (listener->sock_ctx)
+    {
+        listener->armed = TRUE;
+        PTHREAD_CALL(pthread_mutex_lock(&sq_lock));
+        _uring_prep_accept(listener);
+        PTHREAD_CALL(pthread_mutex_unlock(&sq_lock));
+    }
+
+    PTHREAD_CALL(pthread_cond_broadcast(&listener->cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&listener->lock));
+}
+
+/* pass on each complete frame in a chunk of the stream, keeping any
+ * incomplete one at the end until the rest of it arrives.  assumes conn's
+ * lock is held.
+ */
+static void _uring_parse(uring_conn_t *conn, const char *data, size_t len)
+{
+    assert(conn && data);
+
+    while (len > 0)
+    {
+        uint16_t packet_len;
+
+        if (conn->rx_partial_len > 0)
+        {
+            /* first complete the frame we already have part of */
+            size_t need = sizeof(packet_len) - conn->rx_partial_len;
+
+            if (conn->rx_partial_len >= sizeof(packet_len))
+            {
+                memcpy(&packet_len, conn->rx_partial, sizeof(packet_len));
+                need = sizeof(packet_len) + ntohs(packet_len) -
+                       conn->rx_partial_len;
+            }
+
+            need = MIN(need, len);
+            memcpy(conn->rx_partial + conn->rx_partial_len, data, need);
+            conn->rx_partial_len += need;
+            data += need;
+            len  -= need;
+
+            if (conn->rx_partial_len < sizeof(packet_len))
+                continue;
+
+            memcpy(&packet_len, conn->rx_partial, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (conn->rx_partial_len == sizeof(packet_len) + packet_len)
+            {
+                _uring_deliver(conn, conn->rx_partial + sizeof(packet_len),
+                               packet_len);
+                conn->rx_partial_len = 0;
+            }
+            continue;
+        }
+
+        if (len >= sizeof(packet_len))
+        {
+            memcpy(&packet_len, data, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (len >= sizeof(packet_len) + packet_len)
+            {
+                _uring_deliver(conn, data + sizeof(packet_len), packet_len);
+                data += sizeof(packet_len) + packet_len;
+                len  -= sizeof(packet_len) + packet_len;
+                continue;
+            }
+        }
+
+        memcpy(conn->rx_partial, data, len);
+        conn->rx_partial_len = len;
+        break;
+    }
+}
+
+/* queue a packet for the stream's mysocket, or, if it has none yet, treat
+ * it as a SYN for the listener.  assumes conn's lock is held.
+ */
+static void _uring_deliver(uring_conn_t *conn,
+                           const char *packet, size_t packet_len)
+{
+    assert(conn && packet);
+
+    if (packet_len > MYSOCK_BUF_SIZE || conn->closing)
+        return;
+
+    if (conn->sock_ctx)
+    {
+        mysock_buf_t *buf = _mysock_buf_alloc(packet_len);
+        struct iovec slice;
+
+        memcpy(buf->data, packet, packet_len);
+        slice.iov_base = buf->data;
+        slice.iov_len  = packet_len;
+        _mysock_enqueue_refs(conn->sock_ctx, &conn->sock_ctx->network_recv_queue,
+                             &buf, &slice, 1);
+    }
+    else if (conn->listener)
+    {
+        uring_listener_t *listener = conn->listener;
+        bool_t queued = FALSE;
+
+        conn->listener = NULL;
+
+        PTHREAD_CALL(pthread_mutex_lock(&listener->lock));
+        if (listener->sock_ctx)
+        {
+            queued = _mysock_enqueue_connection(listener->sock_ctx,
+                                                packet, packet_len,
+                                                &conn->peer_addr,
+                                                conn->peer_addr_len, conn);
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&listener->lock));
+        _uring_listener_release(listener);
+
+        if (!queued)
+            _uring_conn_orphan(conn);
+    }
+}
+
+/* drop a reference to the listener, freeing it with the last one */
+static void _uring_listener_release(uring_listener_t *listener)
+{
+    int refcnt;
+
+    assert(listener);
+
+    PTHREAD_CALL(pthread_mutex_lock(&listener->lock));
+    assert(listener->refcnt > 0);
+    refcnt = --listener->refcnt;
+    PTHREAD_CALL(pthread_mutex_unlock(&listener->lock));
+
+    if (refcnt > 0)
+        return;
+
+    assert(!listener->armed && !listener->sock_ctx);
+    PTHREAD_CALL(pthread_cond_destroy(&listener->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&listener->lock));
+    free(listener);
+}
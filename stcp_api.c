@@ -5,6 +5,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <alloca.h>
 #include <netinet/in.h>
 #include "mysock.h"
 #include "mysock_impl.h"
@@ -14,8 +15,16 @@
 #include "connection_demux.h"
 #include "tcp_sum.h"
 #include "transport.h"
+#include "mysock_trace.h"
+#include "mysock_pcap.h"
 
-#define LOG_PACKET TRUE
+
+static void _stcp_network_recv_done(mysocket_t sd, const void *packet,
+                                    ssize_t len);
+static int _stcp_prepare_segment(mysocket_t sd, mysock_context_t *ctx,
+                                 const struct iovec *iov, int iovcnt,
+                                 uint32_t *header_buf, struct iovec *out_iov);
+static void _stcp_fill_header(mysock_context_t *ctx, struct tcphdr *header);
 
 /* called by the transport layer thread to unblock the calling application,
  * e.g. when the connection is complete, or when an error is detected while
@@ -90,38 +99,10 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
         if (rc)
             break;
 
-        if (abstime)
-        {
-            /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock,
-                                           abstime))
-            {
-            case 0: /* some data might be available */
-            case EINTR:
-                break;
-
-            case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
-
-            case EINVAL:
-                assert(0);
-                break;
-
-            default:
-                assert(0);
-                break;
-            }
-        }
-        else
-        {
-            /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock));
-        }
+        if (_mysock_wait_data_ready(ctx, &ctx->transport_cond,
+                                    abstime) == ETIMEDOUT)
+            break;  /* no data arrived in the specified time */
     }
-
-done:
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
     return rc;
@@ -145,6 +126,17 @@ void *stcp_get_context(mysocket_t sd)
     return ctx->stcp_state;
 }
 
+/* fetch the connection's options (see mysetsockopt()) */
+void stcp_get_options(mysocket_t sd, stcp_options_t *opts)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && opts);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    *opts = ctx->opts;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
 /* stcp_network_recv
  *
  * Receive a datagram from the peer.  The call blocks until data is
@@ -160,52 +152,124 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     ssize_t len = _network_recv(sd, dst, max_len);
 
+    _stcp_network_recv_done(sd, dst, len);
+    return len;
+}
+
+/* stcp_network_recv_borrow
+ *
+ * As stcp_network_recv(), but rather than copying the datagram into a
+ * buffer supplied by the caller, this lends the caller the buffer it
+ * arrived in.  *segment is set to the datagram, and *buf to the buffer
+ * holding it (or NULL if nothing was received).  The segment is
+ * read-only, as the buffer may be shared with the datagrams after it (e.g.
+ * a GRO batch); the caller may pass slices of it to the application with
+ * stcp_app_send_borrowed(), and must return it with stcp_buf_release()
+ * when done.
+ */
+ssize_t stcp_network_recv_borrow(mysocket_t sd, stcp_buf_t **buf,
+                                 void **segment)
+{
+    ssize_t len;
+
+    assert(buf && segment);
+
+    len = _network_recv_ref(sd, buf, segment);
+    _stcp_network_recv_done(sd, *segment, len);
+
+    if (len <= 0)
+    {
+        stcp_buf_release(*buf);
+        *buf = NULL;
+        *segment = NULL;
+    }
+    return len;
+}
+
+/* stcp_network_recv_many
+ *
+ * Borrow up to max_count datagrams from the peer, as if by repeated calls
+ * to stcp_network_recv_borrow(), but with a single acquisition of the
+ * receive queue's lock.  This blocks until at least one datagram is
+ * available, but takes only those already waiting after that.  segs[i]
+ * describes the i'th datagram; each buffer must be released with
+ * stcp_buf_release().  Returns the number of datagrams received.
+ */
+int stcp_network_recv_many(mysocket_t sd, stcp_rx_segment_t *segs,
+                           int max_count)
+{
+    stcp_buf_t **bufs;
+    void       **data;
+    size_t      *lens;
+    int          count, k;
+
+    assert(segs && max_count > 0);
+
+    bufs = (stcp_buf_t **) alloca(max_count * sizeof(*bufs));
+    data = (void **) alloca(max_count * sizeof(*data));
+    lens = (size_t *) alloca(max_count * sizeof(*lens));
+
+    count = _network_recv_refs(sd, bufs, data, lens, max_count);
+    for (k = 0; k < count; ++k)
+    {
+        _stcp_network_recv_done(sd, data[k], lens[k]);
+
+        segs[k].buf     = bufs[k];
+        segs[k].segment = data[k];
+        segs[k].len     = lens[k];
+
+        if (lens[k] == 0)
+        {
+            stcp_buf_release(bufs[k]);
+            segs[k].buf     = NULL;
+            segs[k].segment = NULL;
+        }
+    }
+
+    return count;
+}
+
+/* drop the caller's reference to a buffer obtained from
+ * stcp_network_recv_borrow().  buf may be NULL.
+ */
+void stcp_buf_release(stcp_buf_t *buf)
+{
+    _mysock_buf_release(buf);
+}
+
+/* bookkeeping common to stcp_network_recv() and
+ * stcp_network_recv_borrow(), for a datagram just received.
+ */
+static void _stcp_network_recv_done(mysocket_t sd, const void *packet,
+                                    ssize_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
     /* checksum should have been verified by underlying network layer in
      * this implementation.
      */
-    assert(len <= 0 ||
-           _mysock_verify_checksum(_mysock_get_context(sd), dst, len));
+    assert(len <= 0 || _mysock_verify_checksum(ctx, packet, len));
 
-    if (LOG_PACKET) {
-        mysock_context_t *ctx = _mysock_get_context(sd);
-        char              packet[MAX_IP_PAYLOAD_LEN];
-        struct tcphdr    *header;
+    if (len >= (ssize_t) sizeof(struct tcphdr))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->info_lock));
+        ++ctx->info.stcpi_segs_rcvd;
+        ctx->info.stcpi_bytes_rcvd += len - TCP_DATA_START(packet);
+        ctx->info.stcpi_peer_window =
+            ntohs(((const struct tcphdr *) packet)->th_win);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->info_lock));
+    }
 
-        assert(ctx && dst);
-        memcpy(packet, dst, len);
-        header = (struct tcphdr *) packet;
+    if (len > 0)
+    {
+        struct iovec iov;
 
-        header->th_sport = _network_get_port(&ctx->network_state);
-        /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+        iov.iov_base = (void *) packet;
+        iov.iov_len  = len;
 
-        assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-        header->th_dport =
-            ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-        assert(header->th_dport > 0);
-
-        char filename[100];
-        snprintf(filename, 99, "pcap_from_%d_to_%d.txt",
-            ntohs(header->th_sport), ntohs(header->th_dport));
-        FILE *fp = fopen(filename, "a");
-        fprintf(fp, "RECV:\t");
-
-        if (header->th_flags == TH_SYN) fprintf(fp, "SYN\t");
-        else if (header->th_flags == (TH_SYN | TH_ACK)) fprintf(fp, "SYNACK\t");
-        else if (header->th_flags == TH_ACK) fprintf(fp, "ACK\t");
-        else if (header->th_flags == TH_FIN) fprintf(fp, "FIN\t");
-        else if (header->th_flags == (TH_FIN | TH_ACK)) fprintf(fp, "FINACK\t");
-        else fprintf(fp, "ERR(%d)\t", header->th_flags);
-
-        fprintf(fp, "%10d\t%10d\t%10ld\t%10d",
-            ntohl(header->th_seq), ntohl(header->th_ack),
-            len, ntohs(header->th_win));
-
-        fprintf(fp, "\n");
-        fflush(fp);
-        fclose(fp);
+        _mysock_trace_packet(sd, TRACE_RECV, packet, len);
+        _mysock_pcap_packet(ctx, TRACE_RECV, &iov, 1);
     }
-
-    return len;
 }
 
 /* stcp_network_send()
@@ -223,7 +287,7 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  *
  * stcp_network_send(mysd, buf1, len1, buf2, len2, NULL);
  *
- * Unreliability is handled by a helper function (_network_send()); if we're
+ * Unreliability is handled by a helper function (_network_sendv()); if we're
  * operating in unreliable mode, we decide in there whether to drop the
  * datagram or send it later.
  *
@@ -232,70 +296,195 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
-    const void       *next_buf;
-    va_list           argptr;
-    struct tcphdr    *header;
-
-    assert(ctx && src);
+    struct iovec *iov;
+    const void   *next_buf;
+    va_list       argptr;
+    int           iovcnt = 1, k;
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
-    packet_len = src_len;
+    assert(src);
 
     va_start(argptr, src_len);
     while ((next_buf = va_arg(argptr, const void *)))
     {
-        size_t next_len = va_arg(argptr, size_t);
+        (void) va_arg(argptr, size_t);
+        ++iovcnt;
+    }
+    va_end(argptr);
 
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
-        packet_len += next_len;
+    iov = (struct iovec *) alloca(iovcnt * sizeof(struct iovec));
+    iov[0].iov_base = (void *) src;
+    iov[0].iov_len  = src_len;
+
+    va_start(argptr, src_len);
+    for (k = 1; k < iovcnt; ++k)
+    {
+        iov[k].iov_base = (void *) va_arg(argptr, const void *);
+        iov[k].iov_len  = va_arg(argptr, size_t);
     }
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
-
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
-
-    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-    header->th_dport =
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-    assert(header->th_dport > 0);
-
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
-
-    if (LOG_PACKET) {
-        char filename[100];
-        snprintf(filename, 99, "pcap_from_%d_to_%d.txt",
-            ntohs(header->th_sport), ntohs(header->th_dport));
-        FILE *fp = fopen(filename, "a");
-        fprintf(fp, "SEND:\t");
-
-        if (header->th_flags == TH_SYN) fprintf(fp, "SYN\t");
-        else if (header->th_flags == (TH_SYN | TH_ACK)) fprintf(fp, "SYNACK\t");
-        else if (header->th_flags == TH_ACK) fprintf(fp, "ACK\t");
-        else if (header->th_flags == TH_FIN) fprintf(fp, "FIN\t");
-        else if (header->th_flags == (TH_FIN | TH_ACK)) fprintf(fp, "FINACK\t");
-        else fprintf(fp, "ERR(%d)\t", header->th_flags);
-
-        fprintf(fp, "%10d\t%10d\t%10ld\t%10d",
-            ntohl(header->th_seq), ntohl(header->th_ack),
-            packet_len, ntohs(header->th_win));
-
-        fprintf(fp, "\n");
-        fflush(fp);
-        fclose(fp);
+    return stcp_network_sendv(sd, iov, iovcnt);
+}
+
+/* stcp_network_sendv()
+ *
+ * Gather-send version of stcp_network_send().  Only the STCP header is
+ * copied (so the fields below can be filled in without modifying the
+ * caller's buffer); the payload is handed to the network layer in place,
+ * and reaches the kernel in a single system call.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    uint32_t          header_buf[15];   /* largest possible header */
+    struct iovec     *out_iov;
+    int               out_cnt;
+
+    assert(ctx && iov && iovcnt > 0);
+
+    out_iov = (struct iovec *) alloca((iovcnt + 1) * sizeof(struct iovec));
+    out_cnt = _stcp_prepare_segment(sd, ctx, iov, iovcnt, header_buf, out_iov);
+    return _network_sendv(sd, out_iov, out_cnt);
+}
+
+/* stcp_network_send_many()
+ *
+ * Send count segments, each described as for stcp_network_sendv(), with a
+ * single call into the network layer (a single writev() for the TCP
+ * network).  Returns the total number of bytes transferred on success, or
+ * -1 on failure.
+ */
+ssize_t stcp_network_send_many(mysocket_t sd, const stcp_tx_segment_t *segs,
+                               int count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    uint32_t        (*header_bufs)[15];
+    struct iovec     *out_iov;
+    int              *out_cnts;
+    int               total_iov = 0, out_pos = 0, k;
+
+    assert(ctx && segs && count >= 0);
+    if (count == 0)
+        return 0;
+
+    for (k = 0; k < count; ++k)
+    {
+        assert(segs[k].iov && segs[k].iovcnt > 0);
+        total_iov += segs[k].iovcnt + 1;
+    }
+
+    header_bufs = (uint32_t (*)[15]) alloca(count * sizeof(*header_bufs));
+    out_iov  = (struct iovec *) alloca(total_iov * sizeof(struct iovec));
+    out_cnts = (int *) alloca(count * sizeof(int));
+
+    for (k = 0; k < count; ++k)
+    {
+        out_cnts[k] = _stcp_prepare_segment(sd, ctx,
+                                            segs[k].iov, segs[k].iovcnt,
+                                            header_bufs[k], out_iov + out_pos);
+        out_pos += out_cnts[k];
+    }
+
+    return _network_send_many(sd, out_iov, out_cnts, count);
+}
+
+/* copy the STCP header in iov[0] to header_buf (room for 15 words), fill in
+ * the fields the transport layer doesn't set, and describe the finished
+ * segment in out_iov (room for iovcnt + 1 entries), which is checksummed,
+ * traced and captured, ready to be passed to the network layer.  returns
+ * the number of out_iov entries used.
+ */
+static int _stcp_prepare_segment(mysocket_t sd, mysock_context_t *ctx,
+                                 const struct iovec *iov, int iovcnt,
+                                 uint32_t *header_buf, struct iovec *out_iov)
+{
+    struct tcphdr *header;
+    size_t         header_len, packet_len;
+    int            out_cnt = 0, k;
+
+    assert(ctx && iov && iovcnt > 0 && header_buf && out_iov);
+    assert(iov[0].iov_base && iov[0].iov_len >= sizeof(struct tcphdr));
+
+    header_len = TCP_DATA_START(iov[0].iov_base);
+    assert(header_len >= sizeof(struct tcphdr));
+    assert(header_len <= iov[0].iov_len && header_len <= 15 * sizeof(uint32_t));
+
+    memcpy(header_buf, iov[0].iov_base, header_len);
+    header = (struct tcphdr *) header_buf;
+
+    out_iov[out_cnt].iov_base   = header_buf;
+    out_iov[out_cnt++].iov_len  = header_len;
+    packet_len = header_len;
+
+    if (iov[0].iov_len > header_len)
+    {
+        out_iov[out_cnt].iov_base  = (char *) iov[0].iov_base + header_len;
+        out_iov[out_cnt++].iov_len = iov[0].iov_len - header_len;
+        packet_len += iov[0].iov_len - header_len;
+    }
+
+    for (k = 1; k < iovcnt; ++k)
+    {
+        if (iov[k].iov_len == 0)
+            continue;
+
+        assert(iov[k].iov_base);
+        out_iov[out_cnt++] = iov[k];
+        packet_len += iov[k].iov_len;
     }
+    assert(packet_len <= MAX_IP_PAYLOAD_LEN);
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    _stcp_fill_header(ctx, header);
+
+    _mysock_trace_packet(sd, TRACE_SEND, header, packet_len);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->info_lock));
+    ++ctx->info.stcpi_segs_sent;
+    ctx->info.stcpi_bytes_sent += packet_len - header_len;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->info_lock));
+
+    _mysock_set_checksumv(ctx, out_iov, out_cnt);
+    _mysock_pcap_packet(ctx, TRACE_SEND, out_iov, out_cnt);
+    return out_cnt;
+}
+
+/* fill in fields in the TCP header that aren't handled by students.  the
+ * ports are looked up for the first segment sent, and kept in the mysocket
+ * context from then on.
+ */
+static void _stcp_fill_header(mysock_context_t *ctx, struct tcphdr *header)
+{
+    uint16_t sport, dport;
+
+    assert(ctx && header);
+
+    if (__atomic_load_n(&ctx->tx_header_valid, __ATOMIC_ACQUIRE))
+    {
+        sport = ctx->tx_sport;
+        dport = ctx->tx_dport;
+    }
+    else
+    {
+        sport = _network_get_port(&ctx->network_state);
+        /* N.B. assert(sport > 0) fires in the UDP SYN-ACK case */
+
+        assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+        dport =
+            ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
+        assert(dport > 0);
+
+        if (sport > 0)
+        {
+            ctx->tx_sport = sport;
+            ctx->tx_dport = dport;
+            __atomic_store_n(&ctx->tx_header_valid, TRUE, __ATOMIC_RELEASE);
+        }
+    }
+
+    header->th_sport = sport;
+    header->th_dport = dport;
+    header->th_sum   = 0;   /* set by _mysock_set_checksumv() */
+    header->th_urp   = 0;   /* ignored */
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -327,6 +516,50 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     }
 }
 
+/* pass count slices of borrowed buffers up to the application, without
+ * copying them, and with a single wakeup.  slices[i] must lie within
+ * bufs[i]; the caller keeps its own references to the buffers.
+ */
+void stcp_app_send_borrowed(mysocket_t sd, stcp_buf_t *const *bufs,
+                            const struct iovec *slices, int count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int k;
+
+    assert(ctx && bufs && slices && count >= 0);
+    if (count == 0)
+        return;
+
+    for (k = 0; k < count; ++k)
+    {
+        assert(bufs[k] && slices[k].iov_len > 0);
+        _mysock_buf_ref(bufs[k]);
+    }
+
+    DEBUG_LOG(("stcp_app_send_borrowed(%d):  sending %d slices up to app\n",
+               sd, count));
+    _mysock_enqueue_refs(ctx, &ctx->app_send_queue, bufs, slices, count);
+}
+
+/* publish transport-maintained statistics for mygetinfo() */
+void stcp_report_info(mysocket_t sd, const struct stcp_info *info)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && info);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->info_lock));
+    ctx->info.stcpi_srtt            = info->stcpi_srtt;
+    ctx->info.stcpi_rttvar          = info->stcpi_rttvar;
+    ctx->info.stcpi_rto             = info->stcpi_rto;
+    ctx->info.stcpi_cwnd            = info->stcpi_cwnd;
+    ctx->info.stcpi_ssthresh        = info->stcpi_ssthresh;
+    ctx->info.stcpi_bytes_in_flight = info->stcpi_bytes_in_flight;
+    ctx->info.stcpi_retransmits     = info->stcpi_retransmits;
+    ctx->info.stcpi_dup_acks        = info->stcpi_dup_acks;
+    ctx->info.stcpi_out_of_order    = info->stcpi_out_of_order;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->info_lock));
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
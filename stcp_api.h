@@ -7,6 +7,7 @@
 #define __STCP_API_H__
 
 #include <time.h>   /* timespec */
+#include <sys/uio.h>    /* iovec */
 #include "mysock.h" /* mysocket_t */
 
 
@@ -21,6 +22,23 @@ typedef enum
 } stcp_event_type_t;
 
 
+/* per-connection tunables, as set by the application with mysetsockopt()
+ * (see mysock.h for the meaning of each)
+ */
+typedef struct
+{
+    unsigned int sndbuf;
+    unsigned int rcvbuf;
+    bool_t       nodelay;
+    bool_t       cork;
+    int          congestion;
+    unsigned int initial_cwnd;
+    unsigned int mss;
+    unsigned int delack_timeout;
+    int          checksum;
+} stcp_options_t;
+
+
 /* called by the transport layer thread to unblock the calling application,
  * e.g. when the connection is established, or when an error is detected
  * while attempting to make the connection.  the STCP layer may set errno
@@ -71,6 +89,11 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 void stcp_set_context(mysocket_t sd, const void *stcp_state);
 void *stcp_get_context(mysocket_t my_sd);
 
+/* fetch the connection's options.  these are fixed once the connection
+ * starts, so transport_init() need only call this once.
+ */
+void stcp_get_options(mysocket_t sd, stcp_options_t *opts);
+
 /* Receive a datagram from the peer.
  *
  * sd       Mysocket descriptor.
@@ -81,6 +104,43 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Zero-copy receive.  A datagram is borrowed in the (reference-counted)
+ * buffer it arrived in, rather than copied:
+ *
+ * stcp_network_recv_borrow()   Like stcp_network_recv(); sets *buf and
+ *                              *segment to the buffer and the datagram in it.
+ *                              The datagram is read-only:  the buffer may
+ *                              hold other datagrams queued behind it.
+ * stcp_app_send_borrowed()     Like stcp_app_send() for count payload
+ *                              slices, each lying within bufs[i].  The
+ *                              application reads the data in place.
+ * stcp_buf_release()           Return a borrowed buffer.  This must be
+ *                              called once for each buffer borrowed,
+ *                              whether or not slices of it were sent up.
+ */
+typedef struct mysock_buf stcp_buf_t;
+
+ssize_t stcp_network_recv_borrow(mysocket_t sd, stcp_buf_t **buf,
+                                 void **segment);
+void stcp_app_send_borrowed(mysocket_t sd, stcp_buf_t *const *bufs,
+                            const struct iovec *slices, int count);
+void stcp_buf_release(stcp_buf_t *buf);
+
+/* Batched receive.  Borrow up to max_count datagrams at once; this blocks
+ * until at least one is available, and returns the number received.  Each
+ * segs[i].buf must be released with stcp_buf_release() (a NULL buf, with
+ * len 0, is returned if the connection failed).
+ */
+typedef struct
+{
+    stcp_buf_t *buf;
+    void       *segment;
+    ssize_t     len;
+} stcp_rx_segment_t;
+
+int stcp_network_recv_many(mysocket_t sd, stcp_rx_segment_t *segs,
+                           int max_count);
+
 /* Send data (unreliably) to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,12 +158,42 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
+/* As stcp_network_send(), but with the segment described by an array of
+ * iovcnt buffers.  The STCP header (including any options) must be
+ * contained in iov[0]; the remaining data is passed down to the network
+ * without being copied.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* Send count segments, each as for stcp_network_sendv(), in one call to
+ * the network layer (which the UDP layer turns into a single GSO send).
+ * Returns the total number of bytes transferred on success, or -1 on
+ * failure.  The stop-and-wait transport has only one segment to send at a
+ * time, so nothing calls this yet.
+ */
+typedef struct
+{
+    const struct iovec *iov;
+    int                 iovcnt;
+} stcp_tx_segment_t;
+
+ssize_t stcp_network_send_many(mysocket_t sd, const stcp_tx_segment_t *segs,
+                               int count);
+
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* publish the transport layer's RTT estimates, congestion window and event
+ * counters, for the application to retrieve with mygetinfo().  only the
+ * fields marked as reported by the transport layer in struct stcp_info
+ * (see mysock.h) are used; the remaining counters are maintained by the
+ * stub code itself.
+ */
+void stcp_report_info(mysocket_t sd, const struct stcp_info *info);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
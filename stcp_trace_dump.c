@@ -0,0 +1,89 @@
+/*
+ * stcp_trace_dump.c
+ *
+ * Prints a binary packet trace, as written by the mysocket layer (see
+ * mysettrace()), one segment per line.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "mysock_trace.h"
+
+/* TCP flag bits, as in transport.h */
+#define TF_FIN  0x01
+#define TF_SYN  0x02
+#define TF_ACK  0x10
+
+
+static const char *flags_name(uint8_t flags, char *buf, size_t buf_len)
+{
+    switch (flags)
+    {
+    case TF_SYN:            return "SYN";
+    case TF_SYN | TF_ACK:   return "SYNACK";
+    case TF_ACK:            return "ACK";
+    case TF_FIN:            return "FIN";
+    case TF_FIN | TF_ACK:   return "FINACK";
+    default:
+        snprintf(buf, buf_len, "ERR(%d)", flags);
+        return buf;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename;
+    trace_file_header_t file_header;
+    trace_record_t rec;
+    FILE *fp;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+        exit(1);
+    }
+    filename = argv[1];
+
+    if (!(fp = fopen(filename, "rb")))
+    {
+        perror(filename);
+        exit(1);
+    }
+
+    if (fread(&file_header, sizeof(file_header), 1, fp) != 1 ||
+        memcmp(file_header.magic, TRACE_FILE_MAGIC,
+               sizeof(file_header.magic)) != 0 ||
+        file_header.record_len != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s: not an STCP trace file\n", filename);
+        exit(1);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        char flags_buf[16];
+
+        printf("%" PRIu64 ".%06" PRIu64 "\t",
+               rec.tr_time / 1000000, rec.tr_time % 1000000);
+
+        if (rec.tr_dir == TRACE_DROPPED)
+        {
+            printf("(%u records dropped)\n", (unsigned) rec.tr_seq);
+            continue;
+        }
+
+        printf("%d\t%s:\t%5u -> %5u\t%s\t%10u\t%10u\t%10u\t%10u\n",
+               rec.tr_sd, (rec.tr_dir == TRACE_SEND) ? "SEND" : "RECV",
+               rec.tr_sport, rec.tr_dport,
+               flags_name(rec.tr_flags, flags_buf, sizeof(flags_buf)),
+               (unsigned) rec.tr_seq, (unsigned) rec.tr_ack,
+               rec.tr_len, rec.tr_win);
+    }
+
+    fclose(fp);
+    return 0;
+}
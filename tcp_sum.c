@@ -1,6 +1,7 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
@@ -8,6 +9,24 @@
 #include "tcp_sum.h"
 
 
+static uint32_t _tcp_pseudo_sum(const mysock_context_t *ctx);
+
+
+/* sum the 16-bit words of the TCP pseudo-header's addresses and protocol,
+ * i.e. all of it but the segment length, which varies from segment to
+ * segment.  the sum is the same whichever way round the addresses are.
+ */
+uint32_t _mysock_tcp_pseudo_sum(uint32_t src_addr /*network byte order*/,
+                                uint32_t dst_addr /*network byte order*/)
+{
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    return (src_addr >> 16) + (src_addr & 0xffff) +
+           (dst_addr >> 16) + (dst_addr & 0xffff) +
+           htons(IPPROTO_TCP);  /* the zero byte, then the protocol */
+}
+
 /* computes checksum for TCP segment, based on description in RFCs 793 and
  * 1071, and Berkeley in_cksum().
  */
@@ -16,31 +35,24 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/)
 {
-    struct
-    {
-        uint32_t src_addr;
-        uint32_t dst_addr;
-        uint8_t  zero;
-        uint8_t  protocol;
-        uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    return _mysock_tcp_checksum_pseudo(
+        _mysock_tcp_pseudo_sum(src_addr, dst_addr), packet, len);
+}
 
+/* as _mysock_tcp_checksum(), given the pseudo-header's sum from
+ * _mysock_tcp_pseudo_sum()
+ */
+uint16_t _mysock_tcp_checksum_pseudo(uint32_t pseudo_sum,
+                                     const void *packet,
+                                     size_t len /*host byte order*/)
+{
     unsigned int k;
-    int32_t sum = 0;
+    uint32_t sum;
 
     assert(packet && len >= sizeof(struct tcphdr));
-    assert(sizeof(pseudo_header) == 12);
-
-
-    assert(src_addr > 0);
-    assert(dst_addr > 0);
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    /* the pseudo header, with the segment's length */
+    sum = pseudo_sum + htons(len);
 
     /* process TCP header and payload */
     assert(((long)packet & 2) == 0);
@@ -66,24 +78,104 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
     return (uint16_t) ~sum;
 }
 
-/* update checksum in the given STCP segment */
-void _mysock_set_checksum(const mysock_context_t *ctx,
-                          void *packet, size_t len)
+/* as _mysock_tcp_checksum(), but for a segment gathered from iovcnt
+ * buffers of arbitrary length and alignment.  th_sum must already be zero.
+ */
+uint16_t _mysock_tcp_checksumv(uint32_t src_addr /*network byte order*/,
+                               uint32_t dst_addr /*network byte order*/,
+                               const struct iovec *iov, int iovcnt)
+{
+    return _mysock_tcp_checksumv_pseudo(
+        _mysock_tcp_pseudo_sum(src_addr, dst_addr), iov, iovcnt);
+}
+
+/* as _mysock_tcp_checksumv(), given the pseudo-header's sum */
+uint16_t _mysock_tcp_checksumv_pseudo(uint32_t pseudo_sum,
+                                      const struct iovec *iov, int iovcnt)
 {
-    assert(ctx && packet);
-    assert(len >= sizeof(struct tcphdr));
+    uint64_t sum = pseudo_sum;
+    size_t   len = 0;
+    bool_t   odd = FALSE;   /* next byte is the second of a 16-bit word */
+    int i;
+
+    assert(iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+    assert(((struct tcphdr *) iov[0].iov_base)->th_sum == 0);
+
+    for (i = 0; i < iovcnt; ++i)
+    {
+        const uint8_t *p = (const uint8_t *) iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+        uint16_t tmp;
+
+        len += n;
+
+        /* finish a word split across buffers */
+        if (odd && n > 0)
+        {
+            tmp = 0;
+            ((uint8_t *) &tmp)[1] = *p++;
+            sum += tmp;
+            --n;
+            odd = FALSE;
+        }
+
+        for (; n >= 2; p += 2, n -= 2)
+        {
+            memcpy(&tmp, p, sizeof(tmp));
+            sum += tmp;
+        }
+
+        if (n > 0)
+        {
+            tmp = 0;
+            ((uint8_t *) &tmp)[0] = *p;
+            sum += tmp;
+            odd = TRUE;
+        }
+    }
+
+    /* the pseudo header's length */
+    sum += htons(len);
+
+    /* fold to 16 bits */
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xffff);
+
+    return (uint16_t) ~sum;
+}
+
+/* update checksum in the given STCP segment, whose header is in iov[0].
+ * as with UDP, a zero checksum means none was computed
+ * (MYSOCK_CSUM_NONE); a computed sum of zero is sent as its one's
+ * complement equivalent, 0xffff.
+ */
+void _mysock_set_checksumv(const mysock_context_t *ctx,
+                           const struct iovec *iov, int iovcnt)
+{
+    struct tcphdr *header;
+    uint16_t sum;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+
+    header = (struct tcphdr *) iov[0].iov_base;
+    header->th_sum = 0;
+
+    if (ctx->opts.checksum == MYSOCK_CSUM_NONE)
+        return;
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum(
-        _network_get_local_addr((network_context_t *)
-                                &ctx->network_state), /*src*/
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
-            sin_addr.s_addr,
-        packet, len);
+    sum = _mysock_tcp_checksumv_pseudo(_tcp_pseudo_sum(ctx), iov, iovcnt);
+    header->th_sum = sum ? sum : 0xffff;
 }
 
-/* returns TRUE if checksum is correct, FALSE otherwise */
+/* returns TRUE if checksum is correct (or isn't checked, with
+ * MYSOCK_CSUM_NONE), FALSE otherwise.  a zero sum is only accepted if we
+ * don't check sums ourselves, so that turning checking off for one
+ * connection doesn't weaken it for any other.
+ */
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len)
 {
@@ -92,15 +184,36 @@ bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
     assert(ctx && packet);
     assert(len >= sizeof(struct tcphdr));
 
+    if (ctx->opts.checksum == MYSOCK_CSUM_NONE)
+        return TRUE;
+
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    my_sum = _mysock_tcp_checksum(
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*src*/
-            sin_addr.s_addr,
-        _network_get_local_addr((network_context_t *)
-                                &ctx->network_state), /*dst*/
-        packet, len);
+    my_sum = _mysock_tcp_checksum_pseudo(_tcp_pseudo_sum(ctx), packet, len);
 
-    return my_sum == ((struct tcphdr *) packet)->th_sum;
+    return (my_sum ? my_sum : 0xffff) == ((struct tcphdr *) packet)->th_sum;
 }
 
+/* the pseudo-header sum for the connection's local and peer addresses,
+ * which is worked out on first use, and cached in the network layer
+ * context.
+ */
+static uint32_t _tcp_pseudo_sum(const mysock_context_t *ctx)
+{
+    network_context_t *net_ctx;
+
+    assert(ctx);
+    net_ctx = (network_context_t *) &ctx->network_state;
+
+    if (!__atomic_load_n(&net_ctx->pseudo_sum_valid, __ATOMIC_ACQUIRE))
+    {
+        assert(net_ctx->peer_addr.sa_family == AF_INET);
+
+        net_ctx->pseudo_sum = _mysock_tcp_pseudo_sum(
+            _network_get_local_addr(net_ctx),
+            ((struct sockaddr_in *) &net_ctx->peer_addr)->sin_addr.s_addr);
+        __atomic_store_n(&net_ctx->pseudo_sum_valid, TRUE, __ATOMIC_RELEASE);
+    }
+
+    return net_ctx->pseudo_sum;
+}
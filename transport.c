@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/time.h>
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
@@ -25,6 +26,11 @@ enum { LISTEN, SYN_RCVD, SYN_SENT, ESTABLISHED,
     CLOSE_WAIT, LAST_ACK, CLOSING };    /* obviously you should have more states */
 
 
+/* maximum number of segments received, or coalesced into one delivery,
+ * at a time
+ */
+#define RECV_BATCH_SEGS 16
+
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
@@ -38,12 +44,60 @@ typedef struct
     tcp_seq rcvd_win;
     size_t  rcvd_len;
 
+    /* receive-side batching: segments are taken from the network queue
+     * RECV_BATCH_SEGS at a time, and held in pending[] until the control
+     * loop gets to them.  in-order data segments are passed up to the app
+     * together, in place in the buffers they arrived in, with a single
+     * cumulative ACK.
+     */
+    stcp_rx_segment_t pending[RECV_BATCH_SEGS];
+    int               pending_next;     /* next segment to process */
+    int               pending_count;
+
+    /* RTT estimates and event counters, published to the mysocket layer
+     * with stcp_report_info() for mygetinfo()
+     */
+    struct stcp_info info;
+
+    /* options set by the application (see mysetsockopt()) */
+    stcp_options_t opts;
+
+    /* a close request returned by stcp_wait_for_event() while we were
+     * waiting for something else; handled on the next pass through the
+     * control loop.
+     */
+    bool_t close_pending;
+
     /* any other connection-wide global variables go here */
 } context_t;
 
+/* receive window advertised to the peer */
+#define RCV_WINDOW(ctx) MIN((ctx)->opts.rcvbuf, 0xffff)
+
+/* longest a corked partial segment is held back, in microseconds */
+#define CORK_TIMEOUT 200000
+
+/* RFC 6298 initial and minimum retransmission timeout, in microseconds */
+#define STCP_INITIAL_RTO 1000000
+#define STCP_MIN_RTO     1000000
+
 
 static void generate_initial_seq_num(context_t *ctx);
 static void control_loop(mysocket_t sd, context_t *ctx);
+static ssize_t recv_segment(mysocket_t sd, context_t *ctx,
+                            stcp_buf_t **buf, void **segment);
+static ssize_t recv_packet(mysocket_t sd, context_t *ctx,
+                           void *dst, size_t max_len);
+static void deliver_data_batch(mysocket_t sd, context_t *ctx,
+                               stcp_buf_t *buf, char *payload);
+static void update_rtt(context_t *ctx, const struct timeval *sent_at);
+static size_t fill_segment(mysocket_t sd, context_t *ctx,
+                           char *payload, size_t payload_size);
+static unsigned int poll_event(mysocket_t sd, context_t *ctx,
+                               unsigned int flags,
+                               const struct timespec *abstime);
+static void deadline_after(struct timespec *deadline, unsigned int usec);
+static void free_context(context_t *ctx);
 
 
 /* initialise the transport layer, and start the main loop, handling
@@ -59,6 +113,14 @@ void transport_init(mysocket_t sd, bool_t is_active)
 
     generate_initial_seq_num(ctx);
 
+    stcp_get_options(sd, &ctx->opts);
+
+    /* this transport is stop-and-wait, so only one segment is ever in
+     * flight; the window is reported as configured.
+     */
+    ctx->info.stcpi_cwnd = ctx->opts.initial_cwnd * ctx->opts.mss;
+    ctx->info.stcpi_rto  = STCP_INITIAL_RTO;
+
     /* XXX: you should send a SYN packet here if is_active, or wait for one
      * to arrive if !is_active.  after the handshake completes, unblock the
      * application with stcp_unblock_application(sd).  you may also use
@@ -77,36 +139,38 @@ void transport_init(mysocket_t sd, bool_t is_active)
         header->th_ack = htonl(0);
         header->th_off = sizeof(STCPHeader)/4;
         header->th_flags = TH_SYN;
-        header->th_win = htons(3072);
+        header->th_win = htons(RCV_WINDOW(ctx));
+
+        struct timeval syn_sent_at;
+        gettimeofday(&syn_sent_at, NULL);
 
         //send SYN packet to server
         if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
             errno = ECONNREFUSED;
             free(header);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         ctx->connection_state = SYN_SENT;
 
         //wait for SYN-ACK packet from server
-        stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
         STCPHeader *packet = (STCPHeader *) calloc(1, sizeof(STCPHeader) + STCP_MSS);
         ssize_t numBytes;
-        if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < sizeof(STCPHeader)) {
+        if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         if (packet->th_flags != (TH_SYN | TH_ACK)) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
+        update_rtt(ctx, &syn_sent_at);
         ctx->rcvd_seq = ntohl(packet->th_seq);
         ctx->rcvd_ack = ntohl(packet->th_ack);
         ctx->rcvd_win = ntohs(packet->th_win);
@@ -119,14 +183,14 @@ void transport_init(mysocket_t sd, bool_t is_active)
         header->th_ack = htonl(ctx->rcvd_seq + 1);
         header->th_flags = TH_ACK;
         header->th_off = sizeof(STCPHeader)/4;
-        header->th_win = htons(3072);
+        header->th_win = htons(RCV_WINDOW(ctx));
 
         //send ACK packet to server
         if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         ctx->rcvd_seq += 1;
@@ -137,20 +201,18 @@ void transport_init(mysocket_t sd, bool_t is_active)
     // Server passive open
     else {
         //wait for SYN packet from client
-        stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
         STCPHeader *packet = (STCPHeader *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
         ssize_t numBytes;
-        if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+        if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
             errno = ECONNREFUSED;
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         if (packet->th_flags != TH_SYN) {
             errno = ECONNREFUSED;
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -166,32 +228,30 @@ void transport_init(mysocket_t sd, bool_t is_active)
         header->th_ack = htonl(ctx->rcvd_seq + 1);
         header->th_flags = TH_SYN | TH_ACK;
         header->th_off = sizeof(STCPHeader)/4;
-        header->th_win = htons(3072);
+        header->th_win = htons(RCV_WINDOW(ctx));
 
         //new socket sends SYN-ACK packet to client
         if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
 
         //wait for ACK packet from client
-        stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
-        if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+        if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         if (packet->th_flags != TH_ACK) {
             errno = ECONNREFUSED;
             free(header);
             free(packet);
-            free(ctx);
+            free_context(ctx);
             return;
         }
         ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -205,11 +265,13 @@ void transport_init(mysocket_t sd, bool_t is_active)
         free(packet);
     }
 
+    stcp_report_info(sd, &ctx->info);
+    errno = 0;  /* connected; don't pass up a stale error from libc */
     stcp_unblock_application(sd);
     control_loop(sd, ctx);
 
     /* do any cleanup here */
-    free(ctx);
+    free_context(ctx);
 }
 
 
@@ -227,6 +289,9 @@ static void generate_initial_seq_num(context_t *ctx)
  *   - new data from the application (via mywrite())
  *   - the socket to be closed (via myclose())
  *   - a timeout
+ *
+ * it returns once the connection is closed, or on error; the caller then
+ * frees ctx.
  */
 static void control_loop(mysocket_t sd, context_t *ctx)
 {
@@ -238,7 +303,17 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
         /* see stcp_api.h or stcp_api.c for details of this function */
         /* XXX: you will need to change some of these arguments! */
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
+        stcp_report_info(sd, &ctx->info);
+
+        if (ctx->pending_next < ctx->pending_count)
+            event = NETWORK_DATA;   /* left over from receive batching */
+        else if (ctx->close_pending)
+        {
+            ctx->close_pending = FALSE;
+            event = APP_CLOSE_REQUESTED;
+        }
+        else
+            event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
 
         /* check whether it was the network, app, or a close request */
         if (event & APP_DATA)
@@ -247,47 +322,52 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             /* see stcp_app_recv() */
 
             //mywrite() called
-            char* payload = (char *)calloc(1, STCP_MSS);
+            char* payload = (char *)calloc(1, ctx->opts.mss);
             size_t payload_size;
-            if((payload_size = stcp_app_recv(sd, payload, STCP_MSS)) < 0) {
+            if((payload_size = stcp_app_recv(sd, payload, ctx->opts.mss)) < 0) {
                 errno = ECONNREFUSED;
                 free(payload);
-                free(ctx);
                 return;
             }
+            if (!ctx->opts.nodelay)
+                payload_size = fill_segment(sd, ctx, payload, payload_size);
             // printf("payload: %ssize: %d\n", payload, payload_size);
 
-            //create ACK packet
-            STCPHeader *packet = (STCPHeader *)calloc(1, sizeof(STCPHeader) + payload_size);
+            //create ACK packet header; the payload is sent from where it is
+            STCPHeader *packet = (STCPHeader *)calloc(1, sizeof(STCPHeader));
             packet->th_seq = htonl(ctx->rcvd_ack);
             packet->th_ack = htonl(ctx->rcvd_seq + ctx->rcvd_len);
             packet->th_flags = TH_ACK;
             packet->th_off = sizeof(STCPHeader)/4;
-            packet->th_win = htons(3072);
+            packet->th_win = htons(RCV_WINDOW(ctx));
 
-            memcpy((void*)packet + sizeof(STCPHeader), payload, payload_size);
+            tcp_seq prev_ack = ctx->rcvd_ack;
+            struct timeval sent_at;
+            gettimeofday(&sent_at, NULL);
 
             //send packet to peer
-            if(stcp_network_send(sd, (void *)packet, sizeof(STCPHeader) + payload_size, NULL) < 0) {
+            if(stcp_network_send(sd, (void *)packet, sizeof(STCPHeader), payload, payload_size, NULL) < 0) {
                 errno = ECONNREFUSED;
                 free(payload);
                 free(packet);
-                free(ctx);
                 return;
             }
+            free(packet);
+            ctx->info.stcpi_bytes_in_flight = payload_size;
+            stcp_report_info(sd, &ctx->info);
 
             //wait for ACK packet from peer
-            stcp_wait_for_event(sd, NETWORK_DATA, NULL);
+            if (ctx->pending_next == ctx->pending_count)
+                poll_event(sd, ctx, NETWORK_DATA, NULL);
 
             char *buffer = (char *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
             packet = (STCPHeader *)buffer;
 
             ssize_t numBytes;
-            if((numBytes = stcp_network_recv(sd, (void *)buffer, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+            if((numBytes = recv_packet(sd, ctx, (void *)buffer, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
                 errno = ECONNREFUSED;
                 free(payload);
                 free(packet);
-                free(ctx);
                 return;
             }
             ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -295,6 +375,12 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             ctx->rcvd_win = ntohs(packet->th_win);
             ctx->rcvd_len = numBytes - sizeof(STCPHeader);
 
+            ctx->info.stcpi_bytes_in_flight = 0;
+            if (payload_size > 0 && ctx->rcvd_ack == prev_ack)
+                ++ctx->info.stcpi_dup_acks;
+            else
+                update_rtt(ctx, &sent_at);
+
             // char * rcvd_payload = (char *)calloc(1, ctx->rcvd_len);
             // memcpy(rcvd_payload, buffer + sizeof(STCPHeader), ctx->rcvd_len);
             // payload[ctx->rcvd_len] = '\0';
@@ -307,16 +393,22 @@ static void control_loop(mysocket_t sd, context_t *ctx)
         }
         else if (event & NETWORK_DATA)
         {
-            //wait for data from peer
-            char *buffer = (char *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
-            STCPHeader *packet = (STCPHeader *)buffer;
+            //wait for data from peer (borrowed in place, not copied)
+            stcp_buf_t *seg_buf;
+            void *buffer;
+            STCPHeader *packet;
             ssize_t numBytes;
-            if((numBytes = stcp_network_recv(sd, (void *)buffer , sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+            numBytes = recv_segment(sd, ctx, &seg_buf, &buffer);
+            packet = (STCPHeader *)buffer;
+            if(numBytes < (ssize_t)sizeof(STCPHeader)) {
                 errno = ECONNREFUSED;
-                free(packet);
-                free(ctx);
+                stcp_buf_release(seg_buf);
                 return;
             }
+            if (numBytes > (ssize_t)sizeof(STCPHeader) &&
+                (tcp_seq) ntohl(packet->th_seq) !=
+                    (tcp_seq) (ctx->rcvd_seq + ctx->rcvd_len))
+                ++ctx->info.stcpi_out_of_order;
             ctx->rcvd_seq = ntohl(packet->th_seq);
             ctx->rcvd_ack = ntohl(packet->th_ack);
             ctx->rcvd_win = ntohs(packet->th_win);
@@ -332,8 +424,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             //check if connection is ESTABLISHED
             if(ctx->connection_state != ESTABLISHED) {
                 errno = ECONNREFUSED;
-                free(packet);
-                free(ctx);
+                stcp_buf_release(seg_buf);
                 return;
             }
             
@@ -350,14 +441,13 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 header->th_ack = htonl(ctx->rcvd_seq + 1);
                 header->th_flags = TH_ACK;
                 header->th_off = sizeof(STCPHeader)/4;
-                header->th_win = htons(3072);
+                header->th_win = htons(RCV_WINDOW(ctx));
 
                 //send ACK packet to client
                 if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                     errno = ECONNREFUSED;
                     free(header);
-                    free(packet);
-                    free(ctx);
+                    stcp_buf_release(seg_buf);
                     return;
                 }
                 ctx->connection_state = LAST_ACK;
@@ -367,32 +457,31 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 header->th_ack = htonl(ctx->rcvd_seq + 1);
                 header->th_flags = TH_FIN | TH_ACK;
                 header->th_off = sizeof(STCPHeader)/4;
-                header->th_win = htons(3072);
+                header->th_win = htons(RCV_WINDOW(ctx));
 
                 //send FIN-ACK packet to client 
                 if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                     errno = ECONNREFUSED;
                     free(header);
-                    free(packet);
-                    free(ctx);
+                    stcp_buf_release(seg_buf);
                     return;
                 }
 
-                //wait for ACK packet from client
-                stcp_wait_for_event(sd, NETWORK_DATA, NULL);
+                //done with the (borrowed, read-only) FIN-ACK
+                stcp_buf_release(seg_buf);
+                packet = (STCPHeader *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
 
-                if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+                //wait for ACK packet from client
+                if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 if (packet->th_flags != TH_ACK) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -409,26 +498,27 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             }
             //regular data packet
             else {
-                //myread() called
-                stcp_app_send(sd, ((char *)packet + sizeof(STCPHeader)), (size_t)ctx->rcvd_len);
-                
-                //create ACK packet
+                //myread() called, along with any in-order segments behind it
+                deliver_data_batch(sd, ctx, seg_buf, (char *)packet + sizeof(STCPHeader));
+
+                //create (cumulative) ACK packet
                 STCPHeader *header = (STCPHeader *) calloc(1, sizeof(STCPHeader));
                 header->th_seq = htonl(ctx->rcvd_ack);
                 header->th_ack = htonl(ctx->rcvd_seq + ctx->rcvd_len);
                 header->th_flags = TH_ACK;
                 header->th_off = sizeof(STCPHeader)/4;
-                header->th_win = htons(3072);
+                header->th_win = htons(RCV_WINDOW(ctx));
 
                 //send ACK packet to peer
                 if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                     errno = ECONNREFUSED;
                     free(header);
-                    free(packet);
-                    free(ctx);
+                    stcp_buf_release(seg_buf);
                     return;
                 }
             }
+
+            stcp_buf_release(seg_buf);
         }
         /* the application has requested to close the connection */
         else if (event & APP_CLOSE_REQUESTED)
@@ -436,7 +526,6 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             //check if connection is ESTABLISHED
             if(ctx->connection_state != ESTABLISHED) {
                 errno = ECONNREFUSED;
-                free(ctx);
                 return;
             }
 
@@ -446,28 +535,24 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             header->th_ack = htonl(ctx->rcvd_seq + ctx->rcvd_len);
             header->th_flags = TH_FIN | TH_ACK;
             header->th_off = sizeof(STCPHeader)/4;
-            header->th_win = htons(3072);
+            header->th_win = htons(RCV_WINDOW(ctx));
 
             //send FIN-ACK packet to server
             if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                 errno = ECONNREFUSED;
                 free(header);
-                free(ctx);
                 return;
             }
 
             ctx->connection_state = FIN_WAIT_1;
 
             //wait for ACK packet from server
-            stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
             STCPHeader *packet = (STCPHeader *)calloc(1, sizeof(STCPHeader) + STCP_MSS);
             ssize_t numBytes;
-            if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+            if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
                 errno = ECONNREFUSED;
                 free(header);
                 free(packet);
-                free(ctx);
                 return;
             }
             ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -487,34 +572,29 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 header->th_ack = htonl(ctx->rcvd_seq + 1);
                 header->th_flags = TH_ACK;
                 header->th_off = sizeof(STCPHeader)/4;
-                header->th_win = htons(3072);
+                header->th_win = htons(RCV_WINDOW(ctx));
 
                 //send ACK packet to server
                 if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
 
                 ctx->connection_state = TIME_WAIT;
 
                 //wait for ACK packet from server
-                stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
-                if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+                if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 if (packet->th_flags != TH_ACK) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -527,20 +607,16 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 ctx->connection_state = FIN_WAIT_2;
 
                 //wait for FIN-ACK packet from server
-                stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-
-                if((numBytes = stcp_network_recv(sd, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
+                if((numBytes = recv_packet(sd, ctx, (void *)packet, sizeof(STCPHeader) + STCP_MSS)) < (ssize_t)sizeof(STCPHeader)) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 if (packet->th_flags != (TH_FIN | TH_ACK)) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
                 ctx->rcvd_seq = ntohl(packet->th_seq);
@@ -558,14 +634,13 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 header->th_ack = htonl(ctx->rcvd_seq + 1);
                 header->th_flags = TH_ACK;
                 header->th_off = sizeof(STCPHeader)/4;
-                header->th_win = htons(3072);
+                header->th_win = htons(RCV_WINDOW(ctx));
 
                 //send ACK packet to server
                 if(stcp_network_send(sd, (void *)header, sizeof(STCPHeader), NULL) < 0) {
                     errno = ECONNREFUSED;
                     free(header);
                     free(packet);
-                    free(ctx);
                     return;
                 }
             }
@@ -573,7 +648,6 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 errno = ECONNREFUSED;
                 free(header);
                 free(packet);
-                free(ctx);
                 return;
             }
 
@@ -595,6 +669,228 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 }
 
 
+/* borrow the next segment from the peer.  segments already received in a
+ * batch are returned first; once those run out, the next batch is taken
+ * from the network queue (blocking until at least one segment arrives).
+ */
+static ssize_t recv_segment(mysocket_t sd, context_t *ctx,
+                            stcp_buf_t **buf, void **segment)
+{
+    stcp_rx_segment_t *next;
+
+    assert(ctx && buf && segment);
+
+    if (ctx->pending_next == ctx->pending_count)
+    {
+        ctx->pending_count = stcp_network_recv_many(sd, ctx->pending,
+                                                     RECV_BATCH_SEGS);
+        ctx->pending_next = 0;
+    }
+
+    next = &ctx->pending[ctx->pending_next++];
+    *buf = next->buf;
+    *segment = next->segment;
+    return next->len;
+}
+
+/* as stcp_network_recv(), copying the next segment into dst, but taking it
+ * from those left over from receive batching first, as recv_segment() does.
+ */
+static ssize_t recv_packet(mysocket_t sd, context_t *ctx,
+                           void *dst, size_t max_len)
+{
+    stcp_buf_t *buf;
+    void *segment;
+    ssize_t len;
+
+    assert(ctx && dst);
+
+    len = recv_segment(sd, ctx, &buf, &segment);
+    if (len > (ssize_t) max_len)
+        len = max_len;
+    if (len > 0)
+        memcpy(dst, segment, len);
+
+    stcp_buf_release(buf);
+    return len;
+}
+
+/* release any segments still held from the last receive batch, and free
+ * the context
+ */
+static void free_context(context_t *ctx)
+{
+    assert(ctx);
+
+    while (ctx->pending_next < ctx->pending_count)
+        stcp_buf_release(ctx->pending[ctx->pending_next++].buf);
+    free(ctx);
+}
+
+/* pass the payload of the data segment just received up to the app,
+ * together with any further in-order data segments already received or
+ * waiting in the network queue (similar to GRO), or arriving within the
+ * delayed ACK timeout if one is set.  the whole run is handed over in place
+ * with one stcp_app_send_borrowed(), and ctx is left describing the last
+ * segment coalesced, so the caller's ACK acknowledges all of them.  the
+ * caller keeps its reference to buf.
+ */
+static void deliver_data_batch(mysocket_t sd, context_t *ctx,
+                               stcp_buf_t *buf, char *payload)
+{
+    struct timespec deadline = { 0, 0 };
+    stcp_buf_t  *bufs[RECV_BATCH_SEGS];
+    struct iovec slices[RECV_BATCH_SEGS];
+    int count = 0, k;
+
+    assert(ctx && buf && payload);
+
+    if (ctx->opts.delack_timeout > 0)
+        deadline_after(&deadline, ctx->opts.delack_timeout);
+
+    if (ctx->rcvd_len > 0)
+    {
+        bufs[count] = buf;
+        slices[count].iov_base = payload;
+        slices[count].iov_len = ctx->rcvd_len;
+        ++count;
+    }
+
+    while (ctx->rcvd_len > 0 && count < RECV_BATCH_SEGS &&
+           (ctx->pending_next < ctx->pending_count ||
+            (poll_event(sd, ctx, NETWORK_DATA, &deadline) & NETWORK_DATA)))
+    {
+        stcp_rx_segment_t *rx;
+        STCPHeader *next;
+
+        if (ctx->pending_next == ctx->pending_count)
+        {
+            ctx->pending_count = stcp_network_recv_many(sd, ctx->pending,
+                                                         RECV_BATCH_SEGS);
+            ctx->pending_next = 0;
+        }
+        rx = &ctx->pending[ctx->pending_next];
+        next = (STCPHeader *) rx->segment;
+
+        /* only plain data continuing exactly where the last segment ended
+         * is coalesced; anything else is left for the control loop.
+         */
+        if (rx->len <= (ssize_t)sizeof(STCPHeader) ||
+            next->th_flags != TH_ACK ||
+            (tcp_seq) ntohl(next->th_seq) !=
+                (tcp_seq) (ctx->rcvd_seq + ctx->rcvd_len))
+            break;
+        ++ctx->pending_next;
+
+        ctx->rcvd_seq = ntohl(next->th_seq);
+        ctx->rcvd_ack = ntohl(next->th_ack);
+        ctx->rcvd_win = ntohs(next->th_win);
+        ctx->rcvd_len = rx->len - sizeof(STCPHeader);
+
+        bufs[count] = rx->buf;
+        slices[count].iov_base = (char *) rx->segment + sizeof(STCPHeader);
+        slices[count].iov_len = ctx->rcvd_len;
+        ++count;
+    }
+
+    stcp_app_send_borrowed(sd, bufs, slices, count);
+
+    /* the app queue holds its own references; drop the ones borrowed here */
+    for (k = 1; k < count; ++k)
+        stcp_buf_release(bufs[k]);
+}
+
+/* top up a partial segment with more data from the application, up to the
+ * MSS.  data already queued by mywrite() is always taken; with MYSO_CORK,
+ * we also wait up to CORK_TIMEOUT for more to arrive.  returns the new
+ * payload size.
+ */
+static size_t fill_segment(mysocket_t sd, context_t *ctx,
+                           char *payload, size_t payload_size)
+{
+    struct timespec deadline = { 0, 0 };
+
+    assert(ctx && payload);
+
+    if (ctx->opts.cork)
+        deadline_after(&deadline, CORK_TIMEOUT);
+
+    while (payload_size < ctx->opts.mss &&
+           (poll_event(sd, ctx, APP_DATA, &deadline) & APP_DATA))
+    {
+        payload_size += stcp_app_recv(sd, payload + payload_size,
+                                      ctx->opts.mss - payload_size);
+    }
+
+    return payload_size;
+}
+
+/* stcp_wait_for_event() for callers outside the main control loop.  a close
+ * request is reported regardless of flags, and only once, so it's saved
+ * for the control loop rather than lost.
+ */
+static unsigned int poll_event(mysocket_t sd, context_t *ctx,
+                               unsigned int flags,
+                               const struct timespec *abstime)
+{
+    unsigned int event = stcp_wait_for_event(sd, flags, abstime);
+
+    assert(ctx);
+    if (event & APP_CLOSE_REQUESTED)
+        ctx->close_pending = TRUE;
+    return event & flags;
+}
+
+/* set deadline to usec microseconds from now */
+static void deadline_after(struct timespec *deadline, unsigned int usec)
+{
+    struct timeval now;
+
+    assert(deadline);
+    gettimeofday(&now, NULL);
+
+    deadline->tv_sec  = now.tv_sec + usec / 1000000;
+    deadline->tv_nsec = (now.tv_usec + usec % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* fold a new RTT sample, measured from sent_at until now, into the smoothed
+ * RTT estimate and recompute the RTO (RFC 6298, section 2).
+ */
+static void update_rtt(context_t *ctx, const struct timeval *sent_at)
+{
+    struct timeval now;
+    uint32_t sample, delta;
+
+    assert(ctx && sent_at);
+
+    gettimeofday(&now, NULL);
+    sample = (now.tv_sec - sent_at->tv_sec) * 1000000 +
+             (now.tv_usec - sent_at->tv_usec);
+
+    if (ctx->info.stcpi_srtt == 0)
+    {
+        ctx->info.stcpi_srtt   = sample;
+        ctx->info.stcpi_rttvar = sample / 2;
+    }
+    else
+    {
+        delta = (ctx->info.stcpi_srtt > sample)
+            ? ctx->info.stcpi_srtt - sample : sample - ctx->info.stcpi_srtt;
+        ctx->info.stcpi_rttvar = (3 * ctx->info.stcpi_rttvar + delta) / 4;
+        ctx->info.stcpi_srtt   = (7 * ctx->info.stcpi_srtt + sample) / 8;
+    }
+
+    ctx->info.stcpi_rto = MAX(STCP_MIN_RTO,
+                              ctx->info.stcpi_srtt +
+                              MAX(1, 4 * ctx->info.stcpi_rttvar));
+}
+
+
 /**********************************************************************/
 /* our_dprintf
  *